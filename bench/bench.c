@@ -0,0 +1,273 @@
+#define TOD_NO_MAIN
+#include "tod.c"
+
+// times the stages of a scan separately, on each top level directory of a corpus written by `gen`:
+// walking the tree, reading the files, matching their contents in memory, and the whole scan
+
+#define BENCH_DEFAULT_RUNS 3
+#define MB 1e6
+
+typedef struct{
+    char *path;
+    char *data;   // only loaded for the match stage
+    size_t size;
+} bench_file_t;
+
+typedef struct{
+    bench_file_t *items;
+    size_t count;
+    size_t capacity;
+} bench_files_t;
+
+// the best time of all runs of each stage, in seconds
+typedef struct{
+    size_t files;
+    size_t bytes;
+    size_t matches;
+    double walk;
+    double read;
+    double match;
+    double scan;
+} bench_result_t;
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+void files_append(bench_files_t *files, const char *path)
+{
+    if (files->count == files->capacity){
+        files->capacity = files->capacity == 0 ? MATCHES_INIT_CAPACITY : files->capacity*2;
+        files->items = realloc(files->items, files->capacity*sizeof(*files->items));
+        assert(files->items != NULL && "Out of memory!");
+    }
+    bench_file_t file = {.path=strdup(path)};
+    assert(file.path != NULL && "Out of memory!");
+    files->items[files->count++] = file;
+}
+
+void files_free(bench_files_t *files)
+{
+    for (size_t i=0; i<files->count; ++i){
+        free(files->items[i].path);
+        free(files->items[i].data);
+    }
+    free(files->items);
+    memset(files, 0, sizeof(*files));
+}
+
+// collect the regular files below `dirname` the way `search_dir` finds them
+void walk(bench_files_t *files, const char *dirname)
+{
+    DIR *dir = opendir(dirname);
+    if (dir == NULL){
+        fprintf(stderr, "[ERROR] Could not open directory: '%s': %s!\n", dirname, strerror(errno));
+        return;
+    }
+    int dir_fd = dirfd(dir);
+    struct dirent *entry;
+    char path[FILENAME_MAX];
+    while ((entry = readdir(dir))){
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        bool is_dir = entry->d_type == DT_DIR;
+        bool is_reg = entry->d_type == DT_REG;
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK){
+            struct stat attr;
+            if (fstatat(dir_fd, name, &attr, 0) == -1) continue;
+            is_dir = S_ISDIR(attr.st_mode);
+            is_reg = S_ISREG(attr.st_mode);
+        }
+        join_path(dirname, name, path, sizeof(path));
+        if (is_dir && *name != '.') walk(files, path);
+        else if (is_reg) files_append(files, path);
+    }
+    closedir(dir);
+}
+
+// read every file completely into the worker's buffer; returns the amount of bytes read.
+// with `keep`, every file's contents are also copied out for the match stage
+size_t read_files(worker_t *worker, bench_files_t *files, bool keep)
+{
+    size_t total = 0;
+    for (size_t i=0; i<files->count; ++i){
+        bench_file_t *file = &files->items[i];
+        int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+        size_t count = 0;
+        if (fd == -1 || !read_file(worker, fd, 0, SIZE_MAX, &count)){
+            fprintf(stderr, "[ERROR] Could not read file '%s': %s!\n", file->path, strerror(errno));
+        }
+        if (fd != -1) close(fd);
+        total += count;
+        if (keep){
+            file->data = malloc(count + 1);
+            assert(file->data != NULL && "Out of memory!");
+            memcpy(file->data, worker->buffer, count);
+            file->size = count;
+        }
+    }
+    return total;
+}
+
+// search the loaded files in memory; returns the amount of matches
+size_t match_files(worker_t *worker, const bench_files_t *files, const matcher_t *matcher)
+{
+    size_t total = 0;
+    for (size_t i=0; i<files->count; ++i){
+        worker->matches.count = 0;
+        search_buffer(&worker->matches, files->items[i].data, files->items[i].size, matcher, Search_Lines, SIZE_MAX);
+        total += worker->matches.count;
+    }
+    return total;
+}
+
+// run a whole scan of `path` like `tod` does, with the output going to /dev/null
+bool scan_dir(const char *path, const matcher_t *matcher, size_t jobs)
+{
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int stdout_fd = dup(STDOUT_FILENO);
+    if (null_fd == -1 || stdout_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1){
+        fprintf(stderr, "[ERROR] Could not redirect the output to /dev/null: %s!\n", strerror(errno));
+        if (null_fd != -1) close(null_fd);
+        if (stdout_fd != -1) close(stdout_fd);
+        return false;
+    }
+    pool_t pool;
+    pool_init(&pool, jobs, matcher);
+    pool.skip_binary = true;
+    pool.caret = true;
+    pool.flush_size = OUTPUT_BUFFER_SIZE;
+    pool_seed(&pool, Task_Dir, path, NULL);
+    pool_run(&pool);
+    pool_free(&pool);
+    dup2(stdout_fd, STDOUT_FILENO);
+    close(stdout_fd);
+    close(null_fd);
+    return true;
+}
+
+#define best_of(best, runs, ...) do{                 \
+        for (size_t _run=0; _run<(runs); ++_run){    \
+            double _start = now();                   \
+            __VA_ARGS__;                             \
+            double _time = now() - _start;           \
+            if (_run == 0 || _time < (best)) (best) = _time; \
+        }                                            \
+    }while(0)
+
+bool bench_corpus(const char *path, const matcher_t *matcher, size_t runs, size_t jobs, bench_result_t *result)
+{
+    pool_t pool;
+    pool_init(&pool, 1, matcher);
+    worker_t *worker = &pool.workers[0];
+    bench_files_t files = {0};
+    best_of(result->walk, runs, files_free(&files); walk(&files, path));
+    result->files = files.count;
+    best_of(result->read, runs, result->bytes = read_files(worker, &files, false));
+    (void) read_files(worker, &files, true);
+    best_of(result->match, runs, result->matches = match_files(worker, &files, matcher));
+    files_free(&files);
+    bool ok = true;
+    best_of(result->scan, runs, ok = ok && scan_dir(path, matcher, jobs));
+    pool_free(&pool);
+    return ok;
+}
+
+double rate(double amount, double seconds)
+{
+    return seconds > 0 ? amount/seconds : 0;
+}
+
+void print_result(const char *name, const bench_result_t *result)
+{
+    printf("%-12s %8zu %9.1f %9zu | %12.0f | %9.1f %9.0f | %9.1f | %9.1f %9.0f\n",
+           name, result->files, result->bytes/MB, result->matches,
+           rate(result->files, result->walk),
+           rate(result->bytes/MB, result->read), rate(result->files, result->read),
+           rate(result->bytes/MB, result->match),
+           rate(result->bytes/MB, result->scan), rate(result->files, result->scan));
+}
+
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+char *corpus_path = NULL;
+clags_list_t bench_patterns = clags_list();
+uint32_t bench_runs = BENCH_DEFAULT_RUNS;
+uint32_t bench_jobs = 0;
+bool bench_help = false;
+
+int main(int argc, char *argv[])
+{
+    int result = 0;
+    const char *program_name = argv[0];
+    clags_arg_t args[] = {
+        clags_positional(&corpus_path, "corpus_dir", "a corpus written by gen", .value_type=Clags_Path),
+        clags_option('p', "pattern", &bench_patterns, "PATTERN", "a pattern to search for, can be repeated, defaults to 'TODO:'", .is_list=true),
+        clags_option('r', "runs", &bench_runs, "N", "time every stage N times and keep the best, defaults to 3", .value_type=Clags_UInt32),
+        clags_option('j', "jobs", &bench_jobs, "N", "the number of worker threads of the whole scan, defaults to the number of cores", .value_type=Clags_UInt32),
+        clags_flag_help(&bench_help),
+    };
+    clags_config_t config = clags_config(args);
+    if (clags_parse(argc, argv, &config) != NULL){
+        clags_usage(program_name, &config);
+        return_defer(1);
+    }
+    if (bench_help){
+        clags_usage(program_name, &config);
+        return_defer(0);
+    }
+    matcher_t matcher;
+    if (!matcher_init(&matcher, bench_patterns, false)){
+        matcher_free(&matcher);
+        return_defer(1);
+    }
+    size_t runs = bench_runs > 0 ? bench_runs : 1;
+    size_t jobs = bench_jobs > 0 ? bench_jobs : default_jobs();
+    printf("kernel %s, %zu pattern(s), best of %zu run(s), %zu job(s) for the whole scan, warm page cache\n",
+           matcher.count == 1 ? matcher.needle.kernel : "aho-corasick", matcher.count, runs, jobs);
+    printf("%-12s %8s %9s %9s | %12s | %9s %9s | %9s | %9s %9s\n",
+           "corpus", "files", "MB", "matches", "walk files/s", "read MB/s", "files/s", "match MB/s", "scan MB/s", "files/s");
+
+    // every top level directory is benchmarked on its own, in name order, then the corpus as a whole
+    char **names = NULL;
+    size_t name_count = 0;
+    DIR *dir = opendir(corpus_path);
+    if (dir == NULL){
+        fprintf(stderr, "[ERROR] Could not open directory: '%s': %s!\n", corpus_path, strerror(errno));
+        matcher_free(&matcher);
+        return_defer(1);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir))){
+        struct stat attr;
+        if (entry->d_name[0] == '.' || fstatat(dirfd(dir), entry->d_name, &attr, 0) == -1 || !S_ISDIR(attr.st_mode)) continue;
+        names = realloc(names, (name_count+1)*sizeof(*names));
+        assert(names != NULL && "Out of memory!");
+        names[name_count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    qsort(names, name_count, sizeof(*names), compare_names);
+    char path[FILENAME_MAX];
+    for (size_t i=0; i<=name_count; ++i){
+        const char *name = i < name_count ? names[i] : "total";
+        if (i < name_count) join_path(corpus_path, name, path, sizeof(path));
+        else snprintf(path, sizeof(path), "%s", corpus_path);
+        bench_result_t bench = {0};
+        if (!bench_corpus(path, &matcher, runs, jobs, &bench)) result = 1;
+        print_result(name, &bench);
+        fflush(stdout);
+    }
+    for (size_t i=0; i<name_count; ++i) free(names[i]);
+    free(names);
+    matcher_free(&matcher);
+
+defer:
+    clags_list_free(&bench_patterns);
+    return result;
+}
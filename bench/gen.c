@@ -0,0 +1,215 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif // _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define CLAGS_IMPLEMENTATION
+#include <clags.h>
+
+// generates a synthetic corpus for `bench`; every run with the same scale writes the same bytes
+
+#define KIB 1024
+#define MIB (1024*1024)
+
+#define return_defer(value) do{result = (value); goto defer;}while(0)
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+size_t rng_range(size_t lo, size_t hi)
+{
+    return lo + rng_next()%(hi-lo+1);
+}
+
+static const char *words[] = {
+    "int", "size_t", "return", "if", "else", "for", "while", "const", "char", "struct",
+    "buffer", "count", "result", "value", "index", "node", "list", "data", "offset", "len",
+    "=", "==", "+", "-", "*", "(", ")", "{", "}", ";", ",", "->", "0", "1", "NULL",
+};
+
+static const char *tags[] = {"TODO:", "FIXME", "HACK", "TODO:"};
+
+// a file being written, with the amount of bytes written so far
+typedef struct{
+    FILE *file;
+    size_t count;
+} out_t;
+
+void put_cstr(out_t *out, const char *s)
+{
+    size_t len = strlen(s);
+    fwrite(s, 1, len, out->file);
+    out->count += len;
+}
+
+void put_char(out_t *out, char c)
+{
+    fputc(c, out->file);
+    out->count += 1;
+}
+
+// write one line of code without the newline, `len` bytes long give or take a word
+void put_code(out_t *out, size_t len)
+{
+    size_t indent = rng_range(0, 3)*4;
+    for (size_t i=0; i<indent; ++i) put_char(out, ' ');
+    size_t start = out->count;
+    while (out->count - start < len){
+        put_cstr(out, words[rng_next()%(sizeof(words)/sizeof(*words))]);
+        put_char(out, ' ');
+    }
+}
+
+// write lines until the file holds `size` bytes; one in `match_every` lines carries a tag, 0 for none
+void put_lines(out_t *out, size_t size, size_t min_line, size_t max_line, size_t match_every)
+{
+    while (out->count < size){
+        put_code(out, rng_range(min_line, max_line));
+        if (match_every > 0 && rng_next()%match_every == 0){
+            put_cstr(out, "// ");
+            put_cstr(out, tags[rng_next()%(sizeof(tags)/sizeof(*tags))]);
+            put_cstr(out, " handle the remaining cases");
+        }
+        put_char(out, '\n');
+    }
+}
+
+// write random bytes with NUL bytes and the occasional tag, the way object files and images look
+void put_binary(out_t *out, size_t size)
+{
+    while (out->count < size){
+        uint64_t r = rng_next();
+        if (r%4096 == 0) put_cstr(out, "TODO:");
+        else put_char(out, r%8 == 0 ? '\0' : (char) (r >> 8));
+    }
+}
+
+bool make_dir(const char *path)
+{
+    if (mkdir(path, 0755) == -1 && errno != EEXIST){
+        fprintf(stderr, "[ERROR] Could not create directory '%s': %s!\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+typedef enum{
+    Content_Code,
+    Content_Long_Lines,
+    Content_Binary,
+    Content_Dense,
+    Content_Sparse,
+} content_t;
+
+bool write_content(const char *path, content_t content, size_t size)
+{
+    out_t out = {fopen(path, "wb"), 0};
+    if (out.file == NULL){
+        fprintf(stderr, "[ERROR] Could not create file '%s': %s!\n", path, strerror(errno));
+        return false;
+    }
+    switch (content){
+        case Content_Code:       put_lines(&out, size, 8, 80, 50); break;
+        case Content_Long_Lines: put_lines(&out, size, 64*KIB, 1*MIB, 8); break;
+        case Content_Binary:     put_binary(&out, size); break;
+        case Content_Dense:      put_lines(&out, size, 8, 80, 1); break;
+        case Content_Sparse:     put_lines(&out, size, 8, 80, 5000); break;
+    }
+    bool ok = !ferror(out.file);
+    if (fclose(out.file) != 0) ok = false;
+    if (!ok) fprintf(stderr, "[ERROR] Could not write file '%s': %s!\n", path, strerror(errno));
+    return ok;
+}
+
+// a tree `depth` levels deep with `fanout` directories and `files` small files in each directory
+bool write_tree(const char *dirname, size_t depth, size_t fanout, size_t files)
+{
+    if (!make_dir(dirname)) return false;
+    char path[FILENAME_MAX];
+    for (size_t i=0; i<files; ++i){
+        snprintf(path, sizeof(path), "%s/file%zu.c", dirname, i);
+        if (!write_content(path, Content_Code, rng_range(512, 8*KIB))) return false;
+    }
+    if (depth == 0) return true;
+    for (size_t i=0; i<fanout; ++i){
+        snprintf(path, sizeof(path), "%s/dir%zu", dirname, i);
+        if (!write_tree(path, depth-1, fanout, files)) return false;
+    }
+    return true;
+}
+
+// `count` files of `size` bytes each in one directory
+bool write_flat(const char *dirname, content_t content, size_t count, size_t size, const char *extension)
+{
+    if (!make_dir(dirname)) return false;
+    char path[FILENAME_MAX];
+    for (size_t i=0; i<count; ++i){
+        snprintf(path, sizeof(path), "%s/file%zu%s", dirname, i, extension);
+        if (!write_content(path, content, size)) return false;
+    }
+    return true;
+}
+
+char *output_dir = NULL;
+uint32_t scale = 1;
+bool help = false;
+
+int main(int argc, char *argv[])
+{
+    int result = 0;
+    const char *program_name = argv[0];
+    clags_arg_t args[] = {
+        clags_positional(&output_dir, "output_dir", "the directory to write the corpus to"),
+        clags_option('s', "scale", &scale, "N", "multiply the amount of files by N, defaults to 1", .value_type=Clags_UInt32),
+        clags_flag_help(&help),
+    };
+    clags_config_t config = clags_config(args);
+    if (clags_parse(argc, argv, &config) != NULL){
+        clags_usage(program_name, &config);
+        return_defer(1);
+    }
+    if (help){
+        clags_usage(program_name, &config);
+        return_defer(0);
+    }
+    if (scale == 0) scale = 1;
+    if (!make_dir(output_dir)) return_defer(1);
+
+    char path[FILENAME_MAX];
+    const struct{
+        const char *name;
+        content_t content;
+        size_t count;
+        size_t size;
+        const char *extension;
+    } flat[] = {
+        {"wide",       Content_Code,       8000, 2*KIB,   ".c"},
+        {"long_lines", Content_Long_Lines, 10,   2*MIB,   ".txt"},
+        {"binary",     Content_Binary,     200,  64*KIB,  ".bin"},
+        {"dense",      Content_Dense,      40,   512*KIB, ".c"},
+        {"sparse",     Content_Sparse,     40,   1*MIB,   ".c"},
+    };
+    snprintf(path, sizeof(path), "%s/deep", output_dir);
+    if (!write_tree(path, 8, 2, 4*scale)) return_defer(1);
+    for (size_t i=0; i<sizeof(flat)/sizeof(*flat); ++i){
+        snprintf(path, sizeof(path), "%s/%s", output_dir, flat[i].name);
+        if (!write_flat(path, flat[i].content, flat[i].count*scale, flat[i].size, flat[i].extension)) return_defer(1);
+    }
+
+defer:
+    return result;
+}
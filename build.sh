@@ -1,2 +1,2 @@
 #!/bin/bash
-cc -Wall -Wextra -Werror --std=c99 -I. -Icwalk -o tod tod.c cwalk/cwalk.c
+cc -Wall -Wextra -Werror --std=c99 -I. -Icwalk -o tod tod.c cwalk/cwalk.c -pthread
@@ -1,3 +1,7 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif // _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
@@ -5,134 +9,6132 @@
 #include <errno.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOD_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define TOD_NEON
+#endif
+
+// io_uring is driven through the raw system calls, it needs the open and read operations of Linux 5.6
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(IORING_FEAT_CUR_PERSONALITY) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define TOD_URING
+#endif
+#endif
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/inotify.h>)
+#include <sys/inotify.h>
+#define TOD_INOTIFY
+#endif
+#endif
+
+#include <cwalk.h>
+#define CLAGS_IMPLEMENTATION
+#include <clags.h>
+
+#define MMAP_THRESHOLD (1024*1024)
+#define READ_CHUNK_SIZE (64*1024)
+#define ALPHABET_SIZE 256
+#define CACHE_LINE_SIZE 64
+#define DEQUE_INIT_CAPACITY 64
+#define MATCHES_INIT_CAPACITY 16
+#define FIELD_MAX_LENGTH 64     // the longest owner or ticket after a tag
+#define FIELDS_MAX_LENGTH 256   // how far after a tag its fields are looked for
+#define ARENA_BLOCK_SIZE (64*1024)
+#define BINARY_PROBE_SIZE (8*1024)
+#define OUTPUT_BUFFER_SIZE (256*1024)
+#define SORT_DEFAULT_BUDGET (64*1024*1024) // the output --sort holds in memory before it spills to a file
+#define PREFETCH_BATCH_SIZE 32            // files of one directory opened and read ahead together
+#define PREFETCH_SIZE READ_CHUNK_SIZE     // the amount of each file read ahead
+#define SPLIT_DEFAULT_SIZE (16*1024*1024) // files larger than this are searched by several workers
+#define SPLIT_CHUNK_SIZE (4*1024*1024)
+#define BINARY_MAX_CONTROL_PERCENT 25
+#define VISITED_SHARDS 64    // locks of the visited set, so the workers rarely wait for each other
+
+#define WATCH_SETTLE_MS 50    // how long the files changed together are waited for
+#define WATCH_POLL_MS 1000    // how often the roots are walked without inotify
+
+#define SERVE_DEFAULT_PATH ".tod-socket"
+#define SERVE_PROTOCOL "1"
+#define SERVE_TIMEOUT_MS 1000
+#define SERVE_MAX_REQUEST (1024*1024)
+
+#define CACHE_DEFAULT_PATH ".tod-cache"
+#define CACHE_MAGIC "TODC"
+#define PARTIAL_MAGIC "TODP"
+#define BIN_MAGIC "TODB"
+#define CACHE_VERSION 2
+
+#define return_defer(value) do{result = (value); goto defer;}while(0)
+
+typedef struct needle_t needle_t;
+
+// a needle search kernel; returns the first occurrence of the needle in the haystack, or NULL
+typedef const char* (*find_func_t)(const needle_t *needle, const char *hay, size_t size);
+
+// a needle prepared once for all files. it is compared in its folded form: a byte of the haystack matches
+// `folded[i]` once it is or'ed with `fold[i]`, which is 0x20 for letters when case is ignored and 0 otherwise
+struct needle_t{
+    uint8_t shift_table[ALPHABET_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+    const char *text;
+    size_t len;
+    char *folded;        // owned, followed by `fold`
+    const char *fold;
+    uint64_t word;       // needles of up to 8 bytes are compared as one word: `word_mask` covers the needle
+    uint64_t word_fold;
+    uint64_t word_mask;
+    bool ignore_case;
+    find_func_t find;
+    const char *kernel;  // the name of the selected kernel
+};
+
+// an Aho-Corasick automaton over all patterns, stored as a full transition table
+typedef struct{
+    int32_t *transitions;  // transitions[state*ALPHABET_SIZE + byte] is the next state
+    int32_t *output;       // the pattern that ends in a state, or -1
+    int32_t *output_link;  // the next state on the suffix chain that has an output, or -1
+    int32_t *depth;        // the length of the prefix a state stands for
+    size_t state_count;
+    bool start_bytes[ALPHABET_SIZE];
+    unsigned char start_set[4];  // the distinct first bytes of all patterns, if there are at most four
+    unsigned char start_fold[4]; // or'ed into a byte before it is compared with `start_set`, see `needle_t`
+    size_t start_set_count;
+    // when case is ignored, the first letters are too common to skip by alone: `start_set` then pairs them
+    // with the byte `probe_offset` bytes later, which is within the shortest pattern
+    unsigned char probe_set[4];
+    unsigned char probe_fold[4];
+    size_t probe_offset;
+    bool has_avx2;
+} automaton_t;
+
+// the compiled set of patterns, built once in main
+typedef struct{
+    const char **patterns;
+    size_t *lengths;
+    char **tags;           // the labels printed in front of matches
+    size_t count;
+    size_t max_length;     // a window ending this much short of a match cannot hold it
+    bool ignore_case;
+    bool words;            // a pattern that starts or ends with a word character only matches a whole word there
+    needle_t needle;       // the kernel used when there is a single pattern
+    automaton_t automaton; // the automaton used for multiple patterns
+} matcher_t;
+
+// the strictest alignment of anything kept in an arena
+typedef union{
+    void *pointer;
+    uint64_t integer;
+    double floating;
+} arena_align_t;
+
+typedef struct arena_block_t arena_block_t;
+struct arena_block_t{
+    arena_block_t *next;
+    size_t capacity;
+    size_t used;
+    arena_align_t data[];
+};
+
+// a bump allocator owned by one thread; everything in it is released at once by a reset, or freed with it.
+// blocks are kept across resets, so a warmed up arena no longer calls malloc
+typedef struct{
+    arena_block_t *first;
+    arena_block_t *current;
+} arena_t;
+
+// a single match; `text` is the trimmed line and is not NUL terminated. the owner and ticket written right
+// after the tag, like in `TODO(alice): [JIRA-123]`, are offsets into `text`, with a length of 0 if missing
+typedef struct{
+    size_t line;
+    size_t column;
+    uint32_t pattern;
+    uint32_t indent;       // the leading whitespace cut from the line
+    const char *text;
+    size_t text_len;
+    uint32_t owner;
+    uint32_t ticket;
+    uint8_t owner_len;
+    uint8_t ticket_len;
+    char priority;         // the digit of a `P1` field, '\0' if missing
+} match_t;
+
+// the matches of one file, allocated in `arena`
+typedef struct{
+    match_t *items;
+    size_t count;
+    size_t capacity;
+    arena_t *arena;
+} match_list_t;
+
+// a file recorded in the scan cache; all pointers point into the loaded cache file
+typedef struct{
+    const char *path;
+    size_t path_len;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint64_t ino;
+    uint32_t match_count;
+    const char *matches;   // the serialized matches
+    const char *record;    // the whole serialized entry, copied as is into the next cache
+    size_t record_size;
+    atomic_bool visited;
+} cache_entry_t;
+
+typedef struct{
+    const char *path;
+    uint64_t fingerprint;  // the options the cached results depend on
+    time_t started;        // files modified after the scan started are not cached
+    void *blob;
+    size_t blob_size;
+    cache_entry_t *entries;
+    size_t entry_count;
+    size_t *slots;         // an open addressing index of entry indices plus one, 0 marks an empty slot
+    size_t slot_count;
+} cache_t;
+
+// whether printed matches are new, for --watch
+typedef enum{
+    Change_None,
+    Change_Added,
+    Change_Removed,
+} change_t;
+
+// how much of each match is needed
+typedef enum{
+    Search_Lines,  // the line, column and text of every match
+    Search_Count,  // only the amount of matches
+    Search_First,  // only whether there is a match
+} search_mode_t;
+
+typedef enum{
+    Format_Text,
+    Format_Jsonl,
+    Format_Csv,
+    Format_Sarif,
+    Format_Partial,  // the serialized matches of one --shard, combined by `tod merge`
+    Format_Bin,      // one indexed file of fixed-width records, read by `tod query`
+} format_t;
+
+typedef enum{
+    Rule_Literal,    // a plain name
+    Rule_Extension,  // `*` followed by a plain suffix starting with '.'
+    Rule_Glob,       // anything else, matched by `glob_match`
+} rule_kind_t;
+
+typedef struct{
+    const char *pattern;   // without a leading '!', a leading '/' and a trailing '/'
+    size_t len;
+    rule_kind_t kind;
+    bool negated;
+    bool dir_only;
+    bool anchored;         // matched against the path relative to the ignore file instead of the name
+    int32_t next;          // the next lower rule with the same literal key, or -1
+} ignore_rule_t;
+
+typedef struct{
+    const char *key;
+    size_t key_len;
+    rule_kind_t kind;
+    int32_t first;
+} rule_slot_t;
+
+// the compiled rules of the ignore files of one directory; shared by all tasks below it
+typedef struct ignore_t ignore_t;
+struct ignore_t{
+    ignore_t *parent;
+    atomic_size_t refs;
+    char *base;            // the directory the rules are relative to
+    size_t base_len;
+    char *prefix;          // the path of `base` below the ignore file, for ignore files above a root
+
+    char *text;            // the storage of all patterns
+    ignore_rule_t *rules;  // in file order, later rules take precedence
+    size_t count;
+    rule_slot_t *slots;    // literal names and extensions
+    size_t slot_count;
+    int32_t *globs;        // the remaining rules from the highest index down
+    size_t glob_count;
+    bool has_anchored;
+};
+
+typedef enum{
+    Task_Dir,
+    Task_File,
+    Task_Split,  // help searching the chunks of a large file
+} task_kind_t;
+
+// the matches of one chunk of a split file, with its amount of lines
+typedef struct{
+    arena_t arena;
+    match_list_t matches;
+    size_t lines;
+} split_chunk_t;
+
+// a large file searched in chunks by several workers at once, see `search_split`. every worker claims chunks
+// until none are left; the file's own worker merges the results once all of them are searched
+typedef struct{
+    const char *data;
+    size_t size;
+    size_t chunk_count;
+    split_chunk_t *chunks;
+    search_mode_t mode;
+    size_t limit;
+    atomic_size_t next;   // the next chunk to claim
+    atomic_size_t done;   // the chunks searched
+    atomic_size_t refs;   // held by the file's worker and each queued helper task
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  // signalled when the last chunk is searched
+} split_t;
+
+// a place in the output of --sort: the output of a run of files, or a directory whose entries are slots again.
+// all fields but the output of a slot that is not ready yet are guarded by `output_lock`
+typedef struct slot_t slot_t;
+struct slot_t{
+    slot_t *parent;
+    slot_t *next;         // the following sibling in path order
+    slot_t *children;     // the entries of a directory, one allocation; NULL until it is read and for empty ones
+    bool ready;           // the output is complete, or the directory has been read
+    clags_sb_t out;       // the output waiting for the cursor, unless it was spilled
+    off_t spill_offset;
+    size_t spill_size;
+};
+
+// the state of --sort: the slots before the cursor have been written, those after it are buffered up to `budget`
+typedef struct{
+    slot_t root;          // its children are the roots, in the order they were given
+    slot_t *last_root;
+    slot_t *cursor;
+    arena_t arena;        // the root slots
+    size_t budget;
+    size_t buffered;
+    FILE *spill;          // created when the budget is first exceeded
+    off_t spill_size;
+} sorter_t;
+
+// a unit of work; `path` lives in the arena of the worker that queued the task
+typedef struct{
+    task_kind_t kind;
+    char *path;
+    ignore_t *ignore;  // the rules that apply inside the task, retained by the task
+    slot_t *slot;      // where the output of the task goes with --sort, NULL without
+    split_t *split;    // the file to help with, for Task_Split
+} task_t;
+
+// a double-ended task queue; the owning worker pushes and pops at the bottom, thieves steal from the top
+typedef struct{
+    pthread_mutex_t lock;
+    task_t *items;
+    size_t top;
+    size_t count;
+    size_t capacity;
+} deque_t;
+
+typedef struct pool_t pool_t;
+
+// what a worker is busy with, for --stats
+typedef enum{
+    Phase_Idle,
+    Phase_Dir,    // reading directories, stat'ing entries and matching ignore rules
+    Phase_File,   // opening, reading and replaying files and formatting their output
+    Phase_Match,  // searching file contents
+    Phase_Count,
+} phase_t;
+
+// counters of one worker, merged when the scan is done
+typedef struct{
+    uint64_t dirs;
+    uint64_t entries;
+    uint64_t stats;
+    uint64_t files;          // searched or replayed from the cache
+    uint64_t bytes_read;     // searched for matches
+    uint64_t bytes_skipped;  // of binary files and files replayed from the cache
+    uint64_t matches;
+    uint64_t duplicates;     // directories and files skipped because they were visited through another path
+    uint64_t phase_ns[Phase_Count];  // only measured with --stats
+    phase_t phase;
+    uint64_t phase_start;
+} stats_t;
+
+// a file of the directory being searched, opened and partly read before it is searched
+typedef struct{
+    size_t name_offset;    // into the worker's `prefetch_names`
+    struct stat attr;
+    bool have_attr;
+    int fd;                // -1 if the file could not be opened
+    int error;             // the errno of a failed open or read
+    const char *data;      // the start of the file, NULL if nothing was read ahead
+    size_t count;
+} prefetch_t;
+
+#ifdef TOD_URING
+// a minimal io_uring, mapping only what a batch of open and read requests needs
+typedef struct{
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+#endif // TOD_URING
+
+// the amount of matches for each key of one grouping, for --summary; the keys are owned
+typedef struct{
+    char *key;
+    size_t key_len;
+    size_t count;
+} tally_item_t;
+
+typedef struct{
+    tally_item_t *items;
+    size_t count;
+    size_t capacity;
+    size_t *slots;         // an open addressing index of item indices plus one, 0 marks an empty slot
+    size_t slot_count;
+} tally_t;
+
+typedef enum{
+    Tally_Tag,
+    Tally_Owner,
+    Tally_Priority,
+    Tally_Dir,
+    Tally_Count,
+} tally_kind_t;
+
+typedef struct{
+    size_t id;
+    pthread_t thread;
+    pool_t *pool;
+    deque_t deque;
+    clags_sb_t out;      // the output of the file currently being searched
+    arena_t arena;       // the paths of queued tasks, for the whole scan
+    arena_t file_arena;  // reset for every file
+    match_list_t matches;
+    clags_sb_t cache_out;   // serialized cache entries of the files searched by this worker
+    clags_sb_t index_out;   // serialized matches of all files searched by this worker, for --watch
+    size_t cache_out_count;
+    char path[FILENAME_MAX];  // the path of the file currently being searched, built only when needed
+    char *buffer;        // the read buffer for files too small to be worth mapping
+    size_t buffer_capacity;
+    const char *file_data;   // the contents of the file whose matches are printed, for context lines; NULL without
+    size_t file_size;
+    size_t *line_starts;     // the offsets of the first lines of `file_data`, found as far as context lines needed them
+    size_t line_count;
+    size_t line_capacity;
+    bool lines_complete;     // `line_starts` holds every line
+    stats_t stats;
+    tally_t tallies[Tally_Count];  // the matches found by this worker, for --summary
+    prefetch_t prefetch[PREFETCH_BATCH_SIZE];
+    size_t prefetch_count;
+    clags_sb_t prefetch_names;
+    char *prefetch_buffer;    // PREFETCH_SIZE bytes for each prefetched file
+#ifdef TOD_URING
+    uring_t ring;
+    bool has_ring;       // false if io_uring is unavailable, files missing from the page cache are then read ahead by the kernel
+    bool cold;           // the last batch missed the page cache, so the next one is opened through the ring as well
+    char *stale_buffer;  // the prefetch buffer of a ring that failed, only freed with the worker
+#endif // TOD_URING
+} worker_t;
+
+// the directories and files visited by a run, by device and inode, so each is searched once however many links,
+// hardlinks or bind mounts lead to it
+typedef struct{
+    dev_t dev;
+    ino_t ino;
+} file_id_t;
+
+typedef struct{
+    pthread_mutex_t lock;
+    file_id_t *items;      // open addressing, an all zero item marks an empty slot
+    size_t count;
+    size_t capacity;
+} visited_shard_t;
+
+struct pool_t{
+    worker_t *workers;
+    size_t count;
+    const matcher_t *matcher;
+    cache_t *cache;
+    bool skip_binary;
+    bool gitignore;
+    bool unpack;            // search inside compressed files and tar archives
+    bool comments_only;     // drop the matches outside comments, in the languages `language_of` knows
+    bool follow;            // follow symbolic links below the roots, the roots themselves are always followed
+    bool one_file_system;   // do not descend into directories on another device than their parent
+    visited_shard_t visited[VISITED_SHARDS];
+    bool revisit;           // search the files of a run however many names lead to them, for updates of --watch
+    format_t format;
+    search_mode_t mode;
+    size_t max_count;       // the most matches reported per file, 0 for no limit
+    size_t limit;           // the most matches reported in total, 0 for no limit
+    atomic_size_t claimed;  // matches counted against `limit` so far
+    atomic_bool stop;       // set once `limit` is reached; workers then drop their remaining work
+    bool caret;             // print a caret line under each match
+    size_t before;          // the lines printed before each match with --format=text, for -B
+    size_t after;           // and after it, for -A
+    bool sort;              // write the output in path order
+    bool index;             // keep the matches of every file in `index_out`, for --watch
+    bool quiet;             // print nothing
+    bool summary;           // count the matches by tag, owner, priority and directory instead of printing them
+    size_t shard;           // only the files whose path hashes to this shard of `shard_count` are searched
+    size_t shard_count;     // 0 or 1 to search every file
+    sorter_t sorter;
+    bool stats;             // measure the time spent in each phase
+    size_t flush_size;      // the amount of buffered output at which a worker writes it
+    size_t split_size;      // files larger than this are split into chunks searched in parallel, 0 to never split
+    atomic_size_t pending;  // tasks that are queued or running
+    atomic_size_t queued;   // tasks that are queued and may be taken
+    atomic_size_t sleeping; // workers waiting for new tasks
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+// the last results of a file, for --watch
+typedef struct{
+    char *path;            // owned
+    size_t path_len;
+    char *record;          // owned, serialized by `record_matches`; NULL once the file is gone
+    cache_entry_t entry;   // parsed from `record`
+    bool seen;             // found by the last walk of the polling fallback
+} indexed_file_t;
+
+typedef struct{
+    indexed_file_t *items;
+    size_t count;
+    size_t capacity;
+    size_t *slots;         // an open addressing index of item indices plus one, 0 marks an empty slot
+    size_t slot_count;
+} index_t;
+
+// a watched directory or root file
+typedef struct{
+    char *path;            // NULL for an unused watch descriptor
+    ignore_t *ignore;      // the rules inside the directory, retained
+    bool is_dir;
+} watched_t;
+
+typedef struct{
+    watched_t *items;
+    size_t count;
+    size_t capacity;
+} watched_list_t;
+
+typedef struct{
+    pool_t *pool;
+    index_t index;
+    watched_list_t roots;
+    int fd;                // the inotify instance, -1 if the roots are polled instead
+    watched_list_t dirs;   // by watch descriptor
+    clags_sb_t changed;    // the NUL terminated paths to search again, possibly repeated
+} watch_t;
+
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool output_records_written = false; // guarded by `output_lock`; whether a separated record was written yet
+
+const char* skip_spaces(const char *s, const char *end)
+{
+    while (s < end && isspace((unsigned char)*s)) ++s;
+    return s;
+}
+
+static inline char fold_byte(char c, bool ignore_case)
+{
+    return ignore_case && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) ? 0x20 : 0;
+}
+
+// shifts are capped at 255, which only makes long needles skip less than they could
+void setup_shift_table(const needle_t *needle, uint8_t shift_table[])
+{
+    size_t needle_len = needle->len;
+    uint8_t max_shift = needle_len < UINT8_MAX ? needle_len : UINT8_MAX;
+    memset(shift_table, max_shift, ALPHABET_SIZE);
+    for (size_t i = 0; i+1 < needle_len; i++) {
+        size_t shift = needle_len - i - 1;
+        if (shift > UINT8_MAX) continue;
+        shift_table[(unsigned char)needle->folded[i]] = shift;
+        if (needle->fold[i]) shift_table[(unsigned char)(needle->folded[i] & ~0x20)] = shift;
+    }
+}
+
+// the portable Boyer-Moore-Horspool kernel
+const char* find_horspool(const needle_t *needle, const char *hay, size_t size)
+{
+    size_t needle_len = needle->len;
+    if (needle_len > size) return NULL;
+    size_t i = 0;
+    while (i <= size - needle_len) {
+        size_t j = needle_len;
+        while (j > 0 && needle->folded[j-1] == (hay[i + j-1] | needle->fold[j-1])) {
+            j--;
+        }
+        if (j == 0) return hay+i;
+        unsigned char mismatched_char = hay[i + needle_len - 1];
+        i += needle->shift_table[mismatched_char];
+    }
+    return NULL;
+}
+
+// the vectorized kernels compare the first and the last byte of the needle against a whole block of candidate
+// positions at once and only verify the rest of the needle where both match: short needles with a single
+// compare of a word, if it does not reach past `end`
+static inline bool needle_verify(const needle_t *needle, const char *candidate, const char *end)
+{
+    if (needle->len <= 2) return true;
+    if (needle->len <= sizeof(uint64_t) && end-candidate >= (ptrdiff_t) sizeof(uint64_t)){
+        uint64_t word;
+        memcpy(&word, candidate, sizeof(word));
+        return ((word | needle->word_fold) & needle->word_mask) == needle->word;
+    }
+    if (!needle->ignore_case) return memcmp(candidate+1, needle->text+1, needle->len-2) == 0;
+    for (size_t i=1; i+1<needle->len; ++i){
+        if ((candidate[i] | needle->fold[i]) != needle->folded[i]) return false;
+    }
+    return true;
+}
+
+#ifdef TOD_X86
+#ifdef __i386__
+__attribute__((target("sse2")))
+#endif
+const char* find_sse2(const needle_t *needle, const char *hay, size_t size)
+{
+    size_t last = needle->len - 1;
+    if (needle->len > size) return NULL;
+    const __m128i first_byte = _mm_set1_epi8(needle->folded[0]);
+    const __m128i last_byte = _mm_set1_epi8(needle->folded[last]);
+    const __m128i first_fold = _mm_set1_epi8(needle->fold[0]);
+    const __m128i last_fold = _mm_set1_epi8(needle->fold[last]);
+    size_t i = 0;
+    for (; i + last + 16 <= size; i += 16){
+        __m128i block_first = _mm_or_si128(_mm_loadu_si128((const __m128i*)(hay+i)), first_fold);
+        __m128i block_last = _mm_or_si128(_mm_loadu_si128((const __m128i*)(hay+i+last)), last_fold);
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(first_byte, block_first), _mm_cmpeq_epi8(last_byte, block_last));
+        unsigned mask = _mm_movemask_epi8(eq);
+        while (mask != 0){
+            unsigned bit = __builtin_ctz(mask);
+            if (needle_verify(needle, hay+i+bit, hay+size)) return hay+i+bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_horspool(needle, hay+i, size-i);
+}
+
+__attribute__((target("avx2")))
+const char* find_avx2(const needle_t *needle, const char *hay, size_t size)
+{
+    size_t last = needle->len - 1;
+    if (needle->len > size) return NULL;
+    const __m256i first_byte = _mm256_set1_epi8(needle->folded[0]);
+    const __m256i last_byte = _mm256_set1_epi8(needle->folded[last]);
+    const __m256i first_fold = _mm256_set1_epi8(needle->fold[0]);
+    const __m256i last_fold = _mm256_set1_epi8(needle->fold[last]);
+    size_t i = 0;
+    for (; i + last + 32 <= size; i += 32){
+        __m256i block_first = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(hay+i)), first_fold);
+        __m256i block_last = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(hay+i+last)), last_fold);
+        __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(first_byte, block_first), _mm256_cmpeq_epi8(last_byte, block_last));
+        unsigned mask = _mm256_movemask_epi8(eq);
+        while (mask != 0){
+            unsigned bit = __builtin_ctz(mask);
+            if (needle_verify(needle, hay+i+bit, hay+size)) return hay+i+bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_sse2(needle, hay+i, size-i);
+}
+#endif // TOD_X86
+
+#ifdef TOD_NEON
+const char* find_neon(const needle_t *needle, const char *hay, size_t size)
+{
+    size_t last = needle->len - 1;
+    if (needle->len > size) return NULL;
+    const uint8x16_t first_byte = vdupq_n_u8(needle->folded[0]);
+    const uint8x16_t last_byte = vdupq_n_u8(needle->folded[last]);
+    const uint8x16_t first_fold = vdupq_n_u8(needle->fold[0]);
+    const uint8x16_t last_fold = vdupq_n_u8(needle->fold[last]);
+    size_t i = 0;
+    for (; i + last + 16 <= size; i += 16){
+        uint8x16_t block_first = vorrq_u8(vld1q_u8((const uint8_t*)(hay+i)), first_fold);
+        uint8x16_t block_last = vorrq_u8(vld1q_u8((const uint8_t*)(hay+i+last)), last_fold);
+        uint8x16_t eq = vandq_u8(vceqq_u8(first_byte, block_first), vceqq_u8(last_byte, block_last));
+        // narrow each byte lane to 4 bits to get a 64-bit mask
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        while (mask != 0){
+            unsigned bit = __builtin_ctzll(mask)/4;
+            if (needle_verify(needle, hay+i+bit, hay+size)) return hay+i+bit;
+            mask &= ~(0xFull << (bit*4));
+        }
+    }
+    return find_horspool(needle, hay+i, size-i);
+}
+#endif // TOD_NEON
+
+// prepare a needle and pick the fastest kernel the cpu supports; with `ignore_case` ASCII letters match
+// in either case
+void needle_init(needle_t *needle, const char *text, bool ignore_case)
+{
+    needle->text = text;
+    needle->len = strlen(text);
+    needle->ignore_case = ignore_case;
+    needle->folded = malloc(2*needle->len);
+    assert(needle->folded != NULL && "Out of memory!");
+    char *fold = needle->folded+needle->len;
+    for (size_t i=0; i<needle->len; ++i){
+        fold[i] = fold_byte(text[i], ignore_case);
+        needle->folded[i] = text[i] | fold[i];
+    }
+    needle->fold = fold;
+    char word[sizeof(uint64_t)] = {0}, word_fold[sizeof(uint64_t)] = {0}, word_mask[sizeof(uint64_t)] = {0};
+    for (size_t i=0; i<needle->len && i<sizeof(word); ++i){
+        word[i] = needle->folded[i];
+        word_fold[i] = fold[i];
+        word_mask[i] = (char) 0xff;
+    }
+    memcpy(&needle->word, word, sizeof(word));
+    memcpy(&needle->word_fold, word_fold, sizeof(word_fold));
+    memcpy(&needle->word_mask, word_mask, sizeof(word_mask));
+    setup_shift_table(needle, needle->shift_table);
+    needle->find = find_horspool;
+    needle->kernel = "horspool";
+#if defined(TOD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        needle->find = find_avx2;
+        needle->kernel = "avx2";
+    } else if (__builtin_cpu_supports("sse2")){
+        needle->find = find_sse2;
+        needle->kernel = "sse2";
+    }
+#elif defined(TOD_NEON)
+    needle->find = find_neon;
+    needle->kernel = "neon";
+#endif
+}
+
+static inline size_t arena_align(size_t size)
+{
+    return (size + sizeof(arena_align_t)-1) & ~(sizeof(arena_align_t)-1);
+}
+
+void* arena_alloc(arena_t *arena, size_t size)
+{
+    size = arena_align(size);
+    arena_block_t *block = arena->current;
+    if (block != NULL && block->capacity - block->used >= size){
+        void *data = (char*) block->data + block->used;
+        block->used += size;
+        return data;
+    }
+    // move on to the next block kept from before the last reset, or insert a new one
+    if (block != NULL && block->next != NULL && block->next->capacity >= size){
+        block = block->next;
+    } else {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        arena_block_t *new_block = malloc(sizeof(*new_block) + capacity);
+        assert(new_block != NULL && "Out of memory!");
+        new_block->capacity = capacity;
+        new_block->next = block != NULL ? block->next : NULL;
+        if (block != NULL) block->next = new_block;
+        else arena->first = new_block;
+        block = new_block;
+    }
+    block->used = size;
+    arena->current = block;
+    return block->data;
+}
+
+// resize the allocation `data` of `old_size` bytes; the last allocation grows in place if there is room
+void* arena_grow(arena_t *arena, void *data, size_t old_size, size_t new_size)
+{
+    arena_block_t *block = arena->current;
+    size_t old_aligned = arena_align(old_size);
+    size_t new_aligned = arena_align(new_size);
+    if (data != NULL && block != NULL && (char*) data + old_aligned == (char*) block->data + block->used &&
+        block->used - old_aligned + new_aligned <= block->capacity){
+        block->used = block->used - old_aligned + new_aligned;
+        return data;
+    }
+    void *grown = arena_alloc(arena, new_size);
+    if (old_size > 0) memcpy(grown, data, old_size < new_size ? old_size : new_size);
+    return grown;
+}
+
+char* arena_strdup(arena_t *arena, const char *s)
+{
+    size_t len = strlen(s);
+    char *copy = arena_alloc(arena, len+1);
+    memcpy(copy, s, len+1);
+    return copy;
+}
+
+void arena_reset(arena_t *arena)
+{
+    arena->current = arena->first;
+    if (arena->first != NULL) arena->first->used = 0;
+}
+
+void arena_free(arena_t *arena)
+{
+    for (arena_block_t *block = arena->first, *next; block != NULL; block = next){
+        next = block->next;
+        free(block);
+    }
+    arena->first = arena->current = NULL;
+}
+
+// append to a list with `items`, `count` and `capacity` whose items are allocated in `arena`
+#define arena_append(arena, list, item) do{                                                            \
+        if ((list)->count >= (list)->capacity){                                                       \
+            size_t _capacity = (list)->capacity == 0 ? MATCHES_INIT_CAPACITY : (list)->capacity*2;    \
+            (list)->items = arena_grow((arena), (list)->items, (list)->capacity*sizeof(*(list)->items), \
+                                       _capacity*sizeof(*(list)->items));                              \
+            (list)->capacity = _capacity;                                                              \
+        }                                                                                              \
+        (list)->items[(list)->count++] = (item);                                                       \
+    }while(0)
+
+// make room for `size` more bytes
+void sb_reserve(clags_sb_t *sb, size_t size)
+{
+    if (sb->count + size <= sb->capacity) return;
+    size_t new_capacity = sb->capacity == 0 ? READ_CHUNK_SIZE : sb->capacity*2;
+    while (new_capacity < sb->count + size) new_capacity *= 2;
+    sb->items = realloc(sb->items, new_capacity);
+    assert(sb->items != NULL && "Out of memory!");
+    sb->capacity = new_capacity;
+}
+
+void sb_append(clags_sb_t *sb, const void *data, size_t size)
+{
+    sb_reserve(sb, size);
+    memcpy(sb->items+sb->count, data, size);
+    sb->count += size;
+}
+
+#define sb_append_value(sb, type, value) do{type _v = (value); sb_append((sb), &_v, sizeof(_v));}while(0)
+
+void sb_append_char(clags_sb_t *sb, char c, size_t count)
+{
+    sb_reserve(sb, count);
+    memset(sb->items+sb->count, c, count);
+    sb->count += count;
+}
+
+void sb_append_cstr(clags_sb_t *sb, const char *s)
+{
+    sb_append(sb, s, strlen(s));
+}
+
+void sb_append_uint(clags_sb_t *sb, uint64_t value)
+{
+    char digits[20];
+    size_t count = 0;
+    do{
+        digits[sizeof(digits) - ++count] = '0' + value%10;
+        value /= 10;
+    }while (value > 0);
+    sb_append(sb, digits+sizeof(digits)-count, count);
+}
+
+// allocate `size` bytes starting on a cache line, NULL if out of memory
+void* alloc_aligned(size_t size)
+{
+    void *data;
+    return posix_memalign(&data, CACHE_LINE_SIZE, size) == 0 ? data : NULL;
+}
+
+// with `ignore_case` the automaton is built over the lowercase patterns, and uppercase letters then lead
+// where their lowercase letters do
+bool automaton_build(automaton_t *automaton, const char **patterns, const size_t *lengths, size_t count, bool ignore_case)
+{
+    size_t capacity = 1;
+    for (size_t i=0; i<count; ++i) capacity += lengths[i];
+    // every state's row of transitions starts on a cache line
+    automaton->transitions = alloc_aligned(capacity*ALPHABET_SIZE*sizeof(int32_t));
+    automaton->output = alloc_aligned(capacity*sizeof(int32_t));
+    automaton->output_link = alloc_aligned(capacity*sizeof(int32_t));
+    automaton->depth = malloc(capacity*sizeof(int32_t));
+    int32_t *fail = malloc(capacity*sizeof(int32_t));
+    int32_t *queue = malloc(capacity*sizeof(int32_t));
+    if (!automaton->transitions || !automaton->output || !automaton->output_link || !automaton->depth || !fail || !queue){
+        free(fail);
+        free(queue);
+        return false;
+    }
+    memset(automaton->transitions, 0xff, capacity*ALPHABET_SIZE*sizeof(int32_t));
+    memset(automaton->start_bytes, 0, sizeof(automaton->start_bytes));
+    automaton->output[0] = -1;
+    automaton->depth[0] = 0;
+    automaton->state_count = 1;
+
+    // build the trie
+    for (size_t i=0; i<count; ++i){
+        int32_t state = 0;
+        for (size_t j=0; j<lengths[i]; ++j){
+            unsigned char c = patterns[i][j] | fold_byte(patterns[i][j], ignore_case);
+            int32_t *next = &automaton->transitions[state*ALPHABET_SIZE + c];
+            if (*next < 0){
+                *next = automaton->state_count++;
+                automaton->output[*next] = -1;
+                automaton->depth[*next] = j+1;
+            }
+            state = *next;
+        }
+        // duplicate patterns keep the first tag
+        if (automaton->output[state] < 0) automaton->output[state] = i;
+        unsigned char first = patterns[i][0];
+        automaton->start_bytes[first] = true;
+        if (fold_byte(first, ignore_case)) automaton->start_bytes[first ^ 0x20] = true;
+    }
+
+    // compute the failure links breadth-first and turn the trie into a full transition table
+    size_t head = 0, tail = 0;
+    fail[0] = 0;
+    automaton->output_link[0] = -1;
+    for (int c=0; c<ALPHABET_SIZE; ++c){
+        int32_t *next = &automaton->transitions[c];
+        if (*next < 0){
+            *next = 0;
+        } else {
+            fail[*next] = 0;
+            automaton->output_link[*next] = -1;
+            queue[tail++] = *next;
+        }
+    }
+    while (head < tail){
+        int32_t state = queue[head++];
+        for (int c=0; c<ALPHABET_SIZE; ++c){
+            int32_t *next = &automaton->transitions[state*ALPHABET_SIZE + c];
+            int32_t fallback = automaton->transitions[fail[state]*ALPHABET_SIZE + c];
+            if (*next < 0){
+                *next = fallback;
+            } else {
+                fail[*next] = fallback;
+                automaton->output_link[*next] = automaton->output[fallback] >= 0 ? fallback : automaton->output_link[fallback];
+                queue[tail++] = *next;
+            }
+        }
+    }
+    for (size_t state=0; ignore_case && state<automaton->state_count; ++state){
+        int32_t *row = &automaton->transitions[state*ALPHABET_SIZE];
+        for (int c='A'; c<='Z'; ++c) row[c] = row[c | 0x20];
+    }
+    automaton->start_set_count = 0;
+    for (int c=0; c<ALPHABET_SIZE; ++c){
+        // both cases of a letter are one entry
+        if (!automaton->start_bytes[c] || (fold_byte(c, ignore_case) && c < 'a')) continue;
+        if (automaton->start_set_count == sizeof(automaton->start_set)){
+            automaton->start_set_count = 0;
+            break;
+        }
+        automaton->start_fold[automaton->start_set_count] = fold_byte(c, ignore_case);
+        automaton->start_set[automaton->start_set_count++] = c;
+    }
+    size_t min_length = lengths[0];
+    for (size_t i=1; i<count; ++i) if (lengths[i] < min_length) min_length = lengths[i];
+    automaton->probe_offset = 0;
+    // the pairs are only taken over if there are few enough of them, `start_set` is kept otherwise
+    unsigned char pair_first[sizeof(automaton->probe_set)], pair_probe[sizeof(automaton->probe_set)];
+    size_t pairs = 0;
+    for (size_t i=0; ignore_case && min_length > 1 && i<count && pairs <= sizeof(automaton->probe_set); ++i){
+        unsigned char first = patterns[i][0] | fold_byte(patterns[i][0], true);
+        unsigned char probe = patterns[i][min_length-1] | fold_byte(patterns[i][min_length-1], true);
+        size_t k = 0;
+        while (k < pairs && (pair_first[k] != first || pair_probe[k] != probe)) ++k;
+        if (k < pairs) continue;
+        if (pairs++ == sizeof(automaton->probe_set)) break;
+        pair_first[k] = first;
+        pair_probe[k] = probe;
+    }
+    if (pairs > 0 && pairs <= sizeof(automaton->probe_set)){
+        for (size_t k=0; k<pairs; ++k){
+            automaton->start_set[k] = pair_first[k];
+            automaton->start_fold[k] = fold_byte(pair_first[k], true);
+            automaton->probe_set[k] = pair_probe[k];
+            automaton->probe_fold[k] = fold_byte(pair_probe[k], true);
+        }
+        automaton->start_set_count = pairs;
+        automaton->probe_offset = min_length-1;
+    }
+#ifdef TOD_X86
+    __builtin_cpu_init();
+    automaton->has_avx2 = __builtin_cpu_supports("avx2");
+#endif // TOD_X86
+    free(fail);
+    free(queue);
+    return true;
+}
+
+void automaton_free(automaton_t *automaton)
+{
+    free(automaton->transitions);
+    free(automaton->output);
+    free(automaton->output_link);
+    free(automaton->depth);
+}
+
+#ifdef TOD_X86
+// whether a pattern may start at `hay`: the bytes up to the probe byte are the start of one
+static inline bool automaton_prefix(const automaton_t *automaton, const char *hay)
+{
+    int32_t state = 0;
+    for (size_t i=0; i<=automaton->probe_offset; ++i){
+        state = automaton->transitions[state*ALPHABET_SIZE + (unsigned char)hay[i]];
+    }
+    return (size_t) automaton->depth[state] == automaton->probe_offset+1;
+}
+
+// skip to the next position where a pattern may start, or to where fewer than a block of bytes is left.
+// the blocks are searched for the first byte and the probe byte of one of the pairs, and each candidate
+// is checked against the automaton before it is returned
+#ifdef __i386__
+__attribute__((target("sse2")))
+#endif
+const char* automaton_skip_pairs_sse2(const automaton_t *automaton, const char *hay, const char *end)
+{
+    size_t offset = automaton->probe_offset;
+    size_t count = automaton->start_set_count;
+    __m128i first[4], first_fold[4], probe[4], probe_fold[4];
+    for (size_t k=0; k<count; ++k){
+        first[k] = _mm_set1_epi8(automaton->start_set[k]);
+        first_fold[k] = _mm_set1_epi8(automaton->start_fold[k]);
+        probe[k] = _mm_set1_epi8(automaton->probe_set[k]);
+        probe_fold[k] = _mm_set1_epi8(automaton->probe_fold[k]);
+    }
+    for (; end - hay >= (ptrdiff_t) (16+offset); hay += 16){
+        __m128i block = _mm_loadu_si128((const __m128i*)hay);
+        __m128i later = _mm_loadu_si128((const __m128i*)(hay+offset));
+        __m128i eq = _mm_setzero_si128();
+        for (size_t k=0; k<count; ++k){
+            eq = _mm_or_si128(eq, _mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(block, first_fold[k]), first[k]),
+                                                _mm_cmpeq_epi8(_mm_or_si128(later, probe_fold[k]), probe[k])));
+        }
+        unsigned mask = _mm_movemask_epi8(eq);
+        for (; mask != 0; mask &= mask - 1){
+            if (automaton_prefix(automaton, hay + __builtin_ctz(mask))) return hay + __builtin_ctz(mask);
+        }
+    }
+    return hay;
+}
+
+__attribute__((target("avx2")))
+const char* automaton_skip_pairs_avx2(const automaton_t *automaton, const char *hay, const char *end)
+{
+    size_t offset = automaton->probe_offset;
+    size_t count = automaton->start_set_count;
+    __m256i first[4], first_fold[4], probe[4], probe_fold[4];
+    for (size_t k=0; k<count; ++k){
+        first[k] = _mm256_set1_epi8(automaton->start_set[k]);
+        first_fold[k] = _mm256_set1_epi8(automaton->start_fold[k]);
+        probe[k] = _mm256_set1_epi8(automaton->probe_set[k]);
+        probe_fold[k] = _mm256_set1_epi8(automaton->probe_fold[k]);
+    }
+    for (; end - hay >= (ptrdiff_t) (32+offset); hay += 32){
+        __m256i block = _mm256_loadu_si256((const __m256i*)hay);
+        __m256i later = _mm256_loadu_si256((const __m256i*)(hay+offset));
+        __m256i eq = _mm256_setzero_si256();
+        for (size_t k=0; k<count; ++k){
+            eq = _mm256_or_si256(eq, _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_or_si256(block, first_fold[k]), first[k]),
+                                                      _mm256_cmpeq_epi8(_mm256_or_si256(later, probe_fold[k]), probe[k])));
+        }
+        unsigned mask = _mm256_movemask_epi8(eq);
+        for (; mask != 0; mask &= mask - 1){
+            if (automaton_prefix(automaton, hay + __builtin_ctz(mask))) return hay + __builtin_ctz(mask);
+        }
+    }
+    return automaton_skip_pairs_sse2(automaton, hay, end);
+}
+#endif // TOD_X86
+
+// skip ahead to the next byte that can start a pattern while the automaton is in its root state
+const char* automaton_skip(const automaton_t *automaton, const char *hay, const char *end)
+{
+    const unsigned char *set = automaton->start_set;
+    const unsigned char *fold = automaton->start_fold;
+    if (automaton->start_set_count == 1 && fold[0] == 0){
+        const char *next = memchr(hay, set[0], end-hay);
+        return next ? next : end;
+    }
+#ifdef TOD_X86
+    if (automaton->probe_offset > 0){
+        hay = automaton->has_avx2 ? automaton_skip_pairs_avx2(automaton, hay, end) : automaton_skip_pairs_sse2(automaton, hay, end);
+        while (hay < end && !automaton->start_bytes[(unsigned char)*hay]) ++hay;
+        return hay;
+    }
+#endif // TOD_X86
+    switch (automaton->start_set_count){
+#ifdef TOD_X86
+        case 1: case 2: case 3: case 4: {
+            __m128i any[4], any_fold[4];
+            for (size_t k=0; k<4; ++k){
+                any[k] = _mm_set1_epi8(set[k < automaton->start_set_count ? k : 0]);
+                any_fold[k] = _mm_set1_epi8(fold[k < automaton->start_set_count ? k : 0]);
+            }
+            for (; end - hay >= 16; hay += 16){
+                __m128i block = _mm_loadu_si128((const __m128i*)hay);
+                __m128i eq = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(_mm_or_si128(block, any_fold[0]), any[0]),
+                                                       _mm_cmpeq_epi8(_mm_or_si128(block, any_fold[1]), any[1])),
+                                          _mm_or_si128(_mm_cmpeq_epi8(_mm_or_si128(block, any_fold[2]), any[2]),
+                                                       _mm_cmpeq_epi8(_mm_or_si128(block, any_fold[3]), any[3])));
+                unsigned mask = _mm_movemask_epi8(eq);
+                if (mask != 0) return hay + __builtin_ctz(mask);
+            }
+        } break;
+#endif // TOD_X86
+        default: break;
+    }
+    while (hay < end && !automaton->start_bytes[(unsigned char)*hay]) ++hay;
+    return hay;
+}
+
+bool matcher_init(matcher_t *matcher, clags_list_t patterns, bool ignore_case)
+{
+    static const char *default_pattern = "TODO:"; // this line should pop up when you run tod on this directory
+    memset(matcher, 0, sizeof(*matcher));
+    matcher->count = patterns.count > 0 ? patterns.count : 1;
+    matcher->ignore_case = ignore_case;
+    matcher->patterns = malloc(matcher->count*sizeof(*matcher->patterns));
+    matcher->lengths = malloc(matcher->count*sizeof(*matcher->lengths));
+    matcher->tags = calloc(matcher->count, sizeof(*matcher->tags));
+    assert(matcher->patterns && matcher->lengths && matcher->tags && "Out of memory!");
+    for (size_t i=0; i<matcher->count; ++i){
+        const char *pattern = patterns.count > 0 ? clags_list_element(patterns, char*, i) : default_pattern;
+        size_t length = strlen(pattern);
+        if (length == 0){
+            fprintf(stderr, "[ERROR] Patterns may not be empty!\n");
+            return false;
+        }
+        if (memchr(pattern, '\n', length) != NULL){
+            fprintf(stderr, "[ERROR] Patterns may not contain newlines: '%s'!\n", pattern);
+            return false;
+        }
+        matcher->patterns[i] = pattern;
+        matcher->lengths[i] = length;
+        if (length > matcher->max_length) matcher->max_length = length;
+        // label matches by the pattern without a trailing ':'
+        size_t tag_len = length > 1 && pattern[length-1] == ':' ? length-1 : length;
+        matcher->tags[i] = strndup(pattern, tag_len);
+        assert(matcher->tags[i] != NULL && "Out of memory!");
+    }
+    if (matcher->count == 1){
+        needle_init(&matcher->needle, matcher->patterns[0], ignore_case);
+    } else if (!automaton_build(&matcher->automaton, matcher->patterns, matcher->lengths, matcher->count, ignore_case)){
+        fprintf(stderr, "[ERROR] Could not build the pattern automaton: out of memory!\n");
+        return false;
+    }
+    return true;
+}
+
+void matcher_free(matcher_t *matcher)
+{
+    if (matcher->count > 1) automaton_free(&matcher->automaton);
+    else free(matcher->needle.folded);
+    for (size_t i=0; i<matcher->count; ++i){
+        free(matcher->tags[i]);
+    }
+    free(matcher->tags);
+    free(matcher->patterns);
+    free(matcher->lengths);
+}
+
+void matches_append(match_list_t *matches, match_t match)
+{
+    arena_append(matches->arena, matches, match);
+}
+
+static inline bool is_word_byte(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// the languages whose comments --comments-only tells apart, picked by file extension
+typedef enum{
+    Language_None,
+    Language_C,        // and C++
+    Language_Js,       // and TypeScript
+    Language_Rust,
+    Language_Python,
+    Language_Shell,
+} language_t;
+
+static const struct{
+    const char *extension;
+    language_t language;
+} language_extensions[] = {
+    {".c", Language_C}, {".h", Language_C}, {".cc", Language_C}, {".cpp", Language_C}, {".cxx", Language_C},
+    {".hh", Language_C}, {".hpp", Language_C}, {".hxx", Language_C},
+    {".js", Language_Js}, {".mjs", Language_Js}, {".cjs", Language_Js}, {".jsx", Language_Js},
+    {".ts", Language_Js}, {".tsx", Language_Js},
+    {".rs", Language_Rust},
+    {".py", Language_Python}, {".pyi", Language_Python},
+    {".sh", Language_Shell}, {".bash", Language_Shell}, {".zsh", Language_Shell},
+};
+
+language_t language_of(const char *path)
+{
+    const char *extension;
+    size_t length;
+    if (!cwk_path_get_extension(path, &extension, &length)) return Language_None;
+    for (size_t i=0; i<sizeof(language_extensions)/sizeof(*language_extensions); ++i){
+        const char *known = language_extensions[i].extension;
+        if (strlen(known) == length && memcmp(known, extension, length) == 0) return language_extensions[i].language;
+    }
+    return Language_None;
+}
+
+typedef enum{
+    Lex_Code,
+    Lex_Line_Comment,
+    Lex_Block_Comment,
+    Lex_String,
+} lex_state_t;
+
+// follows the comments and strings of a file, for --comments-only. it is run lazily up to each match, so the
+// bytes after a file's last match are never lexed, and code is skipped over until one of `special`
+typedef struct{
+    language_t language;
+    lex_state_t state;
+    char quote;        // the quote that ends the string
+    bool triple;       // a Python string that ends with three quotes
+    bool raw;          // a string without escapes
+    size_t hashes;     // the '#'s after the quote that ends a raw Rust string
+    size_t depth;      // of nested Rust block comments
+    size_t offset;     // the bytes before it are lexed
+    bool special[ALPHABET_SIZE];
+} lexer_t;
+
+void lexer_init(lexer_t *lexer, language_t language)
+{
+    static const char *const special[] = {
+        [Language_None]="",
+        [Language_C]="/\"'",
+        [Language_Js]="/\"'`",
+        [Language_Rust]="/\"'r",
+        [Language_Python]="#\"'",
+        [Language_Shell]="#\"'\\",
+    };
+    memset(lexer, 0, sizeof(*lexer));
+    lexer->language = language;
+    for (const char *c=special[language]; *c; ++c) lexer->special[(unsigned char)*c] = true;
+}
+
+// lex the special byte of code at `i`; returns where lexing goes on
+size_t lex_code(lexer_t *lexer, const char *data, size_t size, size_t i)
+{
+    char c = data[i];
+    char next = i+1 < size ? data[i+1] : '\0';
+    switch (lexer->language){
+        case Language_C: case Language_Js: case Language_Rust:
+            if (c == '/' && next == '/'){
+                lexer->state = Lex_Line_Comment;
+                return i+2;
+            }
+            if (c == '/' && next == '*'){
+                lexer->state = Lex_Block_Comment;
+                lexer->depth = 1;
+                return i+2;
+            }
+            if (c == '/') return i+1;
+            if (c == 'r'){
+                // a raw string is r"..." or r#"..."#, or br"..." for bytes; an r that ends any other identifier is not one
+                bool byte_prefix = i > 0 && data[i-1] == 'b' && (i == 1 || !is_word_byte(data[i-2]));
+                if (i > 0 && is_word_byte(data[i-1]) && !byte_prefix) return i+1;
+                size_t j = i+1;
+                while (j < size && data[j] == '#') ++j;
+                if (j >= size || data[j] != '"') return i+1;
+                lexer->state = Lex_String;
+                lexer->quote = '"';
+                lexer->triple = false;
+                lexer->raw = true;
+                lexer->hashes = j-i-1;
+                return j+1;
+            }
+            // in Rust, a quote that is not a char literal starts a lifetime
+            if (lexer->language == Language_Rust && c == '\'' && next != '\\' && (i+2 >= size || data[i+2] != '\'')) return i+1;
+            break;
+        case Language_Python:
+            if (c == '#'){
+                lexer->state = Lex_Line_Comment;
+                return i+1;
+            }
+            if (i+2 < size && next == c && data[i+2] == c){
+                lexer->state = Lex_String;
+                lexer->quote = c;
+                lexer->triple = true;
+                lexer->raw = false;
+                return i+3;
+            }
+            break;
+        case Language_Shell:
+            if (c == '\\') return i+2;
+            if (c == '#'){
+                // only a word that starts with '#' is a comment, like in `echo a#b # c`
+                if (i == 0 || strchr(" \t\n;|&(", data[i-1]) != NULL) lexer->state = Lex_Line_Comment;
+                return i+1;
+            }
+            break;
+        case Language_None:
+            return i+1;
+    }
+    lexer->state = Lex_String;
+    lexer->quote = c;
+    lexer->triple = false;
+    lexer->raw = lexer->language == Language_Shell && c == '\'';
+    lexer->hashes = 0;
+    return i+1;
+}
+
+// whether a quoted string of the lexer's language ends with its line, unterminated
+static inline bool lex_string_ends_at_newline(const lexer_t *lexer)
+{
+    switch (lexer->language){
+        case Language_C: case Language_Python: return !lexer->triple;
+        case Language_Js: return lexer->quote != '`';
+        default: return false;
+    }
+}
+
+// lex the buffer `data` of `size` bytes up to `offset`; a token that starts before `offset` is lexed whole
+void lexer_advance(lexer_t *lexer, const char *data, size_t size, size_t offset)
+{
+    size_t i = lexer->offset;
+    while (i < offset){
+        switch (lexer->state){
+            case Lex_Code: {
+                while (i < offset && !lexer->special[(unsigned char)data[i]]) ++i;
+                if (i < offset) i = lex_code(lexer, data, size, i);
+            } break;
+            case Lex_Line_Comment: {
+                const char *newline = memchr(data+i, '\n', offset-i);
+                if (newline == NULL){
+                    i = offset;
+                } else {
+                    lexer->state = Lex_Code;
+                    i = newline-data+1;
+                }
+            } break;
+            case Lex_Block_Comment: {
+                // nested comments are only looked for in Rust, anything else jumps to the next '*'
+                if (lexer->language != Language_Rust){
+                    const char *star = memchr(data+i, '*', offset-i);
+                    if (star == NULL){
+                        i = offset;
+                        break;
+                    }
+                    i = star-data;
+                }
+                char next = i+1 < size ? data[i+1] : '\0';
+                if (data[i] == '*' && next == '/'){
+                    if (--lexer->depth == 0) lexer->state = Lex_Code;
+                    i += 2;
+                } else if (lexer->language == Language_Rust && data[i] == '/' && next == '*'){
+                    lexer->depth++;
+                    i += 2;
+                } else {
+                    i += 1;
+                }
+            } break;
+            case Lex_String: {
+                char c = data[i++];
+                if (c == '\\' && !lexer->raw){
+                    i += 1;
+                } else if (c == '\n' && lex_string_ends_at_newline(lexer)){
+                    // an unterminated string, or an apostrophe in a preprocessor line
+                    lexer->state = Lex_Code;
+                } else if (c == lexer->quote){
+                    size_t end = i;
+                    if (lexer->triple){
+                        if (end+1 >= size || data[end] != c || data[end+1] != c) break;
+                        end += 2;
+                    }
+                    size_t hashes = 0;
+                    while (hashes < lexer->hashes && end+hashes < size && data[end+hashes] == '#') ++hashes;
+                    if (hashes < lexer->hashes) break;
+                    lexer->state = Lex_Code;
+                    i = end+hashes;
+                }
+            } break;
+        }
+    }
+    if (i > lexer->offset) lexer->offset = i;
+}
+
+// whether the match at `offset` starts inside a comment
+bool lexer_in_comment(lexer_t *lexer, const char *data, size_t size, size_t offset)
+{
+    lexer_advance(lexer, data, size, offset);
+    return lexer->state == Lex_Line_Comment || lexer->state == Lex_Block_Comment;
+}
+
+// whether a field is a ticket, like `JIRA-123` or `#123`
+static inline bool is_ticket(const char *p, const char *end)
+{
+    if (p < end && *p == '#'){
+        const char *digits = ++p;
+        while (p < end && *p >= '0' && *p <= '9') ++p;
+        return p > digits && p == end;
+    }
+    const char *start = p;
+    while (p < end && ((*p >= 'A' && *p <= 'Z') || (p > start && ((*p >= '0' && *p <= '9') || *p == '_')))) ++p;
+    if (p == start || p == end || *p != '-') return false;
+    const char *digits = ++p;
+    while (p < end && *p >= '0' && *p <= '9') ++p;
+    return p > digits && p == end;
+}
+
+// keep a field found after a tag, unless one of its kind was found before it:
+// `P0` to `P9` is a priority, a ticket is one, and anything else without spaces is an owner
+void match_field(match_t *match, const char *field, const char *end)
+{
+    while (field < end && (*field == ' ' || *field == '\t')) ++field;
+    while (end > field && (end[-1] == ' ' || end[-1] == '\t')) --end;
+    if (field < end && *field == '@') ++field;
+    size_t len = end-field;
+    if (len == 0 || len > FIELD_MAX_LENGTH) return;
+    if (len == 2 && (*field == 'P' || *field == 'p') && field[1] >= '0' && field[1] <= '9'){
+        if (match->priority == '\0') match->priority = field[1];
+    } else if (is_ticket(field, end)){
+        if (match->ticket_len > 0) return;
+        match->ticket = field-match->text;
+        match->ticket_len = len;
+    } else if (match->owner_len == 0 && memchr(field, ' ', len) == NULL && memchr(field, '\t', len) == NULL){
+        match->owner = field-match->text;
+        match->owner_len = len;
+    }
+}
+
+// read the fields right after the tag that ends at `p`: a list in parentheses like `(alice, P1)`, then after an
+// optional ':' any fields in brackets like `[JIRA-123] [P2]`, or a bare ticket. only the bytes up to the end of
+// the fields are looked at, at most FIELDS_MAX_LENGTH of them
+void match_fields(match_t *match, const char *p, const char *end)
+{
+    if (p >= end) return;
+    if ((size_t) (end-p) > FIELDS_MAX_LENGTH) end = p+FIELDS_MAX_LENGTH;
+    if (p < end && *p == '('){
+        const char *close = memchr(p, ')', end-p);
+        if (close == NULL) return;
+        for (const char *field=p+1; field<close;){
+            const char *comma = memchr(field, ',', close-field);
+            if (comma == NULL) comma = close;
+            match_field(match, field, comma);
+            field = comma+1;
+        }
+        p = close+1;
+    }
+    if (p < end && *p == ':') ++p;
+    while (p < end){
+        while (p < end && (*p == ' ' || *p == '\t')) ++p;
+        if (p < end && *p == '['){
+            const char *close = memchr(p, ']', end-p);
+            if (close == NULL) return;
+            match_field(match, p+1, close);
+            p = close+1;
+            continue;
+        }
+        const char *word = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != ':' && *p != ',') ++p;
+        if (match->ticket_len == 0 && p-word <= FIELD_MAX_LENGTH && is_ticket(word, p)){
+            match->ticket = word-match->text;
+            match->ticket_len = p-word;
+        }
+        return;
+    }
+}
+
+// the state of a search over one file buffer; lines are counted lazily up to the latest match
+typedef struct{
+    match_list_t *matches;
+    search_mode_t mode;
+    const char *data;
+    size_t size;
+    size_t line_number;
+    size_t line_start;
+    size_t counted;
+    const size_t *lengths;  // of the patterns
+    lexer_t *lexer;         // drops the matches outside comments, for --comments-only
+} scan_t;
+
+void report_match(scan_t *scan, size_t offset, size_t pattern)
+{
+    if (scan->lexer != NULL && !lexer_in_comment(scan->lexer, scan->data, scan->size, offset)) return;
+    if (scan->mode != Search_Lines){
+        matches_append(scan->matches, (match_t){.pattern=pattern});
+        return;
+    }
+    const char *data = scan->data;
+    // patterns never contain a newline, so a match starting before `counted` lies on the current line
+    if (offset > scan->counted){
+        const char *newline;
+        while ((newline = memchr(data+scan->counted, '\n', offset-scan->counted)) != NULL){
+            scan->line_number++;
+            scan->counted = scan->line_start = newline-data+1;
+        }
+        scan->counted = offset;
+    }
+    const char *line = data+scan->line_start;
+    const char *line_end = memchr(data+offset, '\n', scan->size-offset);
+    if (line_end == NULL) line_end = data+scan->size;
+    if (line_end > line && line_end[-1] == '\r') line_end--;
+    const char *trimmed = skip_spaces(line, line_end);
+    match_t match = {
+        .line=scan->line_number,
+        .column=offset-scan->line_start+1,
+        .pattern=pattern,
+        .indent=trimmed-line,
+        .text=trimmed,
+        .text_len=line_end-trimmed,
+    };
+    match_fields(&match, data+offset+scan->lengths[pattern], line_end);
+    matches_append(scan->matches, match);
+}
+
+// whether a match of `length` bytes at `offset` is not part of a longer word, for --word
+static inline bool at_word_boundary(const char *data, size_t size, size_t offset, size_t length)
+{
+    const char *start = data+offset;
+    const char *end = start+length;
+    if (offset > 0 && is_word_byte(start[0]) && is_word_byte(start[-1])) return false;
+    if (offset+length < size && is_word_byte(end[-1]) && is_word_byte(end[0])) return false;
+    return true;
+}
+
+// search a file buffer for the matches that start in [from, to); they may run past `to`, and their lines are
+// taken from the whole buffer. line numbers and columns are only worked out for the matches and count from `from`,
+// as if a line started there. stops once `matches` holds `limit` matches. with a `lexer`, which must have lexed
+// no further than `from`, only the matches inside comments are kept
+void search_range(match_list_t *matches, const char *data, size_t size, size_t from, size_t to, const matcher_t *matcher, search_mode_t mode, size_t limit, lexer_t *lexer)
+{
+    scan_t scan = {.matches=matches, .mode=mode, .data=data, .size=size, .line_number=1, .line_start=from, .counted=from, .lengths=matcher->lengths, .lexer=lexer};
+    size_t stop = size-to < matcher->max_length-1 ? size : to+matcher->max_length-1;
+    if (matcher->count == 1){
+        const needle_t *needle = &matcher->needle;
+        const char *match;
+        size_t i = from;
+        while ((match = needle->find(needle, data+i, stop-i)) != NULL) {
+            i = match-data;
+            if (matcher->words && !at_word_boundary(data, size, i, needle->len)){
+                i += 1;
+                continue;
+            }
+            report_match(&scan, i, 0);
+            if (matches->count >= limit) return;
+            i += needle->len;
+        }
+        return;
+    }
+    const automaton_t *automaton = &matcher->automaton;
+    const char *end = data+stop;
+    int32_t state = 0;
+    for (const char *p=data+from; p<end; ++p){
+        if (state == 0){
+            p = automaton_skip(automaton, p, end);
+            if (p == end) break;
+        }
+        state = automaton->transitions[state*ALPHABET_SIZE + (unsigned char)*p];
+        for (int32_t hit = automaton->output[state] >= 0 ? state : automaton->output_link[state]; hit >= 0; hit = automaton->output_link[hit]){
+            size_t pattern = automaton->output[hit];
+            size_t start = p-data+1-matcher->lengths[pattern];
+            // a shorter pattern may lie entirely past `to`, it belongs to the next range
+            if (start >= to) continue;
+            if (matcher->words && !at_word_boundary(data, size, start, matcher->lengths[pattern])) continue;
+            report_match(&scan, start, pattern);
+            if (matches->count >= limit) return;
+        }
+    }
+}
+
+// search a whole file buffer
+void search_buffer(match_list_t *matches, const char *data, size_t size, const matcher_t *matcher, search_mode_t mode, size_t limit)
+{
+    search_range(matches, data, size, 0, size, matcher, mode, limit, NULL);
+}
+
+bool write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0){
+        ssize_t n = write(fd, data, size);
+        if (n < 0){
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// the length of the valid UTF-8 sequence at `s`, or 0 if it is invalid
+size_t utf8_sequence(const unsigned char *s, const unsigned char *end)
+{
+    size_t len = s[0] >= 0xf0 && s[0] <= 0xf4 ? 4 : s[0] >= 0xe0 && s[0] <= 0xef ? 3 : s[0] >= 0xc2 && s[0] < 0xe0 ? 2 : 0;
+    if (len == 0 || (size_t)(end-s) < len) return 0;
+    for (size_t i=1; i<len; ++i){
+        if ((s[i] & 0xc0) != 0x80) return 0;
+    }
+    if (len == 3 && ((s[0] == 0xe0 && s[1] < 0xa0) || (s[0] == 0xed && s[1] >= 0xa0))) return 0;
+    if (len == 4 && ((s[0] == 0xf0 && s[1] < 0x90) || (s[0] == 0xf4 && s[1] >= 0x90))) return 0;
+    return len;
+}
+
+// append a JSON string; bytes that are not valid UTF-8 become U+FFFD
+void sb_append_json(clags_sb_t *sb, const char *s, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char*) s, *end = p+len;
+    sb_append_char(sb, '"', 1);
+    while (p < end){
+        const unsigned char *run = p;
+        while (p < end && *p >= 0x20 && *p < 0x80 && *p != '"' && *p != '\\') p++;
+        sb_append(sb, run, p-run);
+        if (p >= end) break;
+        unsigned char c = *p;
+        if (c >= 0x80){
+            size_t n = utf8_sequence(p, end);
+            if (n > 0) sb_append(sb, p, n);
+            else sb_append(sb, "\\ufffd", 6);
+            p += n > 0 ? n : 1;
+            continue;
+        }
+        switch (c){
+            case '"':  sb_append(sb, "\\\"", 2); break;
+            case '\\': sb_append(sb, "\\\\", 2); break;
+            case '\n': sb_append(sb, "\\n", 2); break;
+            case '\r': sb_append(sb, "\\r", 2); break;
+            case '\t': sb_append(sb, "\\t", 2); break;
+            default: {
+                char escape[6] = {'\\', 'u', '0', '0', hex[c>>4], hex[c&0xf]};
+                sb_append(sb, escape, sizeof(escape));
+            } break;
+        }
+        p++;
+    }
+    sb_append_char(sb, '"', 1);
+}
+
+// append a CSV field, quoted if needed; bytes that are not valid UTF-8 become U+FFFD
+void sb_append_csv(clags_sb_t *sb, const char *s, size_t len)
+{
+    bool quote = false;
+    for (size_t i=0; i<len && !quote; ++i){
+        quote = s[i] == ',' || s[i] == '"' || s[i] == '\n' || s[i] == '\r';
+    }
+    if (quote) sb_append_char(sb, '"', 1);
+    const unsigned char *p = (const unsigned char*) s, *end = p+len;
+    while (p < end){
+        const unsigned char *run = p;
+        while (p < end && *p < 0x80 && *p != '"') p++;
+        sb_append(sb, run, p-run);
+        if (p >= end) break;
+        if (*p == '"'){
+            sb_append(sb, "\"\"", 2);
+            p++;
+            continue;
+        }
+        size_t n = utf8_sequence(p, end);
+        if (n > 0) sb_append(sb, p, n);
+        else sb_append(sb, "\xef\xbf\xbd", 3);
+        p += n > 0 ? n : 1;
+    }
+    if (quote) sb_append_char(sb, '"', 1);
+}
+
+// append a relative URI reference for a path
+void sb_append_uri(clags_sb_t *sb, const char *path)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    for (const unsigned char *p = (const unsigned char*) path; *p; ++p){
+        if (isalnum(*p) || strchr("/-._~", *p) != NULL){
+            sb_append_char(sb, *p, 1);
+        } else {
+            char escape[3] = {'%', hex[*p>>4], hex[*p&0xf]};
+            sb_append(sb, escape, sizeof(escape));
+        }
+    }
+}
+
+// print a file with matches, and their amount with --count
+void print_file(worker_t *worker, const char *filename)
+{
+    const pool_t *pool = worker->pool;
+    clags_sb_t *out = &worker->out;
+    size_t filename_len = strlen(filename);
+    bool count = pool->mode == Search_Count;
+    if (worker->matches.count == 0) return;
+    switch (pool->format){
+        case Format_Text: {
+            sb_append(out, filename, filename_len);
+            if (count){
+                sb_append_char(out, ':', 1);
+                sb_append_uint(out, worker->matches.count);
+            }
+            sb_append_char(out, '\n', 1);
+        } break;
+        case Format_Jsonl: {
+            sb_append_cstr(out, "{\"file\":");
+            sb_append_json(out, filename, filename_len);
+            if (count){
+                sb_append_cstr(out, ",\"count\":");
+                sb_append_uint(out, worker->matches.count);
+            }
+            sb_append(out, "}\n", 2);
+        } break;
+        case Format_Csv: {
+            sb_append_csv(out, filename, filename_len);
+            if (count){
+                sb_append_char(out, ',', 1);
+                sb_append_uint(out, worker->matches.count);
+            }
+            sb_append(out, "\r\n", 2);
+        } break;
+        case Format_Sarif: assert(false && "SARIF output always lists matches"); break;
+        case Format_Partial: assert(false && "partial output always lists matches"); break;
+        case Format_Bin: assert(false && "binary output always lists matches"); break;
+    }
+}
+
+void summary_add(worker_t *worker, const char *filename);
+void record_matches(clags_sb_t *out, const char *filename, const struct stat *attr, const match_list_t *matches);
+
+void push_line_start(worker_t *worker, size_t offset)
+{
+    if (worker->line_count == worker->line_capacity){
+        worker->line_capacity = worker->line_capacity == 0 ? MATCHES_INIT_CAPACITY : worker->line_capacity*2;
+        worker->line_starts = realloc(worker->line_starts, worker->line_capacity*sizeof(*worker->line_starts));
+        assert(worker->line_starts != NULL && "Out of memory!");
+    }
+    worker->line_starts[worker->line_count++] = offset;
+}
+
+// the offset of line `line` of `worker->file_data`, counted from 1, or SIZE_MAX past its last line. the index
+// of line starts is only extended up to the lines asked for, and only files with matches ask
+size_t line_start(worker_t *worker, size_t line)
+{
+    const char *data = worker->file_data;
+    size_t size = worker->file_size;
+    if (worker->line_count == 0 && !worker->lines_complete){
+        if (size == 0) worker->lines_complete = true;
+        else push_line_start(worker, 0);
+    }
+    while (worker->line_count < line && !worker->lines_complete){
+        size_t last = worker->line_starts[worker->line_count-1];
+        const char *newline = memchr(data+last, '\n', size-last);
+        size_t next = newline != NULL ? (size_t) (newline-data) + 1 : size;
+        if (next >= size) worker->lines_complete = true;
+        else push_line_start(worker, next);
+    }
+    return line <= worker->line_count ? worker->line_starts[line-1] : SIZE_MAX;
+}
+
+// print lines `from` to `to` of the file as context, like `file-12- text`; returns the last line printed
+size_t print_context(worker_t *worker, const char *filename, size_t filename_len, size_t from, size_t to)
+{
+    clags_sb_t *out = &worker->out;
+    const char *data = worker->file_data;
+    size_t size = worker->file_size;
+    size_t line = from;
+    for (; line<=to; ++line){
+        size_t start = line_start(worker, line);
+        if (start == SIZE_MAX) break;
+        const char *newline = memchr(data+start, '\n', size-start);
+        size_t end = newline != NULL ? (size_t) (newline-data) : size;
+        if (end > start && data[end-1] == '\r') end -= 1;
+        sb_append(out, filename, filename_len);
+        sb_append_char(out, '-', 1);
+        sb_append_uint(out, line);
+        sb_append(out, "- ", 2);
+        sb_append(out, data+start, end-start);
+        sb_append_char(out, '\n', 1);
+    }
+    return line-1;
+}
+
+// `change` marks the matches as added or removed, for --watch
+void print_matches(worker_t *worker, const char *filename, change_t change)
+{
+    const pool_t *pool = worker->pool;
+    const matcher_t *matcher = pool->matcher;
+    const match_list_t *matches = &worker->matches;
+    clags_sb_t *out = &worker->out;
+    if (pool->summary){
+        summary_add(worker, filename);
+        return;
+    }
+    if (pool->format == Format_Partial){
+        // the file attributes only matter to the cache
+        struct stat none = {0};
+        record_matches(out, filename, &none, matches);
+        return;
+    }
+    if (pool->format == Format_Bin){
+        // kept until the scan is done, `bin_write` writes them in path order
+        struct stat none = {0};
+        record_matches(&worker->index_out, filename, &none, matches);
+        return;
+    }
+    if (pool->mode != Search_Lines){
+        print_file(worker, filename);
+        return;
+    }
+    size_t filename_len = strlen(filename);
+    bool context = worker->file_data != NULL && (pool->before > 0 || pool->after > 0);
+    size_t printed = 0;  // the last line printed with context, 0 for none
+    for (size_t i=0; i<matches->count; ++i){
+        const match_t *match = &matches->items[i];
+        const char *tag = matcher->tags[match->pattern];
+        switch (pool->format){
+            case Format_Text: {
+                if (context && match->line > printed){
+                    size_t from = match->line > pool->before ? match->line - pool->before : 1;
+                    if (from <= printed) from = printed+1;
+                    // groups of lines that do not touch are told apart like grep does
+                    if (printed > 0 && from > printed+1) sb_append(out, "--\n", 3);
+                    print_context(worker, filename, filename_len, from, match->line-1);
+                    printed = match->line;
+                }
+                size_t start = out->count;
+                if (change != Change_None) sb_append_char(out, change == Change_Added ? '+' : '-', 1);
+                sb_append(out, filename, filename_len);
+                sb_append_char(out, ':', 1);
+                sb_append_uint(out, match->line);
+                sb_append_char(out, ':', 1);
+                sb_append_uint(out, match->column);
+                sb_append(out, ": ", 2);
+                if (matcher->count > 1){
+                    sb_append_char(out, '[', 1);
+                    sb_append_cstr(out, tag);
+                    sb_append(out, "] ", 2);
+                }
+                size_t format_len = out->count - start;
+                sb_append(out, match->text, match->text_len);
+                sb_append_char(out, '\n', 1);
+                if (pool->caret){
+                    sb_append_char(out, ' ', format_len+match->column-1-match->indent);
+                    sb_append(out, "^\n", 2);
+                }
+                // the lines after a match end where the next match is
+                bool last_on_line = i+1 == matches->count || matches->items[i+1].line != match->line;
+                if (context && last_on_line && pool->after > 0){
+                    size_t to = match->line + pool->after;
+                    if (i+1 < matches->count && matches->items[i+1].line <= to) to = matches->items[i+1].line-1;
+                    printed = print_context(worker, filename, filename_len, printed+1, to);
+                }
+            } break;
+            case Format_Jsonl: {
+                sb_append_char(out, '{', 1);
+                if (change != Change_None) sb_append_cstr(out, change == Change_Added ? "\"change\":\"added\"," : "\"change\":\"removed\",");
+                sb_append_cstr(out, "\"file\":");
+                sb_append_json(out, filename, filename_len);
+                sb_append_cstr(out, ",\"line\":");
+                sb_append_uint(out, match->line);
+                sb_append_cstr(out, ",\"column\":");
+                sb_append_uint(out, match->column);
+                sb_append_cstr(out, ",\"tag\":");
+                sb_append_json(out, tag, strlen(tag));
+                if (match->owner_len > 0){
+                    sb_append_cstr(out, ",\"owner\":");
+                    sb_append_json(out, match->text+match->owner, match->owner_len);
+                }
+                if (match->ticket_len > 0){
+                    sb_append_cstr(out, ",\"ticket\":");
+                    sb_append_json(out, match->text+match->ticket, match->ticket_len);
+                }
+                if (match->priority != '\0'){
+                    sb_append_cstr(out, ",\"priority\":");
+                    sb_append_uint(out, match->priority-'0');
+                }
+                sb_append_cstr(out, ",\"text\":");
+                sb_append_json(out, match->text, match->text_len);
+                sb_append(out, "}\n", 2);
+            } break;
+            case Format_Csv: {
+                sb_append_csv(out, filename, filename_len);
+                sb_append_char(out, ',', 1);
+                sb_append_uint(out, match->line);
+                sb_append_char(out, ',', 1);
+                sb_append_uint(out, match->column);
+                sb_append_char(out, ',', 1);
+                sb_append_csv(out, tag, strlen(tag));
+                sb_append_char(out, ',', 1);
+                sb_append_csv(out, match->text, match->text_len);
+                sb_append(out, "\r\n", 2);
+            } break;
+            case Format_Sarif: {
+                // every result is preceded by a separator, `flush_output` drops the very first one
+                sb_append_cstr(out, ",\n        {\"ruleId\":");
+                sb_append_json(out, tag, strlen(tag));
+                sb_append_cstr(out, ",\"level\":\"note\",\"message\":{\"text\":");
+                sb_append_json(out, match->text, match->text_len);
+                sb_append_cstr(out, "},\"locations\":[{\"physicalLocation\":{\"artifactLocation\":{\"uri\":\"");
+                sb_append_uri(out, filename);
+                sb_append_cstr(out, "\"},\"region\":{\"startLine\":");
+                sb_append_uint(out, match->line);
+                sb_append_cstr(out, ",\"startColumn\":");
+                sb_append_uint(out, match->column);
+                sb_append_cstr(out, "}}}]}");
+            } break;
+            case Format_Partial:
+            case Format_Bin: break;
+        }
+    }
+}
+
+uint64_t cache_fingerprint(const pool_t *pool);
+void record_matches(clags_sb_t *out, const char *filename, const struct stat *attr, const match_list_t *matches);
+
+// append what comes before the first record
+void format_header(const pool_t *pool, clags_sb_t *out)
+{
+    switch (pool->format){
+        case Format_Text:
+        case Format_Jsonl:
+        case Format_Bin: break;
+        case Format_Csv: {
+            switch (pool->mode){
+                case Search_Lines: sb_append_cstr(out, "file,line,column,tag,text\r\n"); break;
+                case Search_Count: sb_append_cstr(out, "file,count\r\n"); break;
+                case Search_First: sb_append_cstr(out, "file\r\n"); break;
+            }
+        } break;
+        case Format_Sarif: {
+            sb_append_cstr(out, "{\n  \"version\": \"2.1.0\",\n  \"$schema\": \"https://json.schemastore.org/sarif-2.1.0.json\",\n");
+            sb_append_cstr(out, "  \"runs\": [{\n    \"tool\": {\"driver\": {\"name\": \"tod\", \"rules\": [");
+            for (size_t i=0; i<pool->matcher->count; ++i){
+                if (i > 0) sb_append(out, ", ", 2);
+                sb_append_cstr(out, "{\"id\": ");
+                sb_append_json(out, pool->matcher->tags[i], strlen(pool->matcher->tags[i]));
+                sb_append_char(out, '}', 1);
+            }
+            sb_append_cstr(out, "]}},\n    \"results\": [");
+        } break;
+        case Format_Partial: {
+            // read back by `partial_load`; the patterns are kept with their NUL terminators
+            const matcher_t *matcher = pool->matcher;
+            sb_append(out, PARTIAL_MAGIC, 4);
+            sb_append_value(out, uint32_t, CACHE_VERSION);
+            sb_append_value(out, uint64_t, cache_fingerprint(pool));
+            sb_append_value(out, uint32_t, pool->shard);
+            sb_append_value(out, uint32_t, pool->shard_count > 0 ? pool->shard_count : 1);
+            sb_append_value(out, uint32_t, matcher->count);
+            for (size_t i=0; i<matcher->count; ++i){
+                sb_append_value(out, uint32_t, matcher->lengths[i]);
+                sb_append(out, matcher->patterns[i], matcher->lengths[i]+1);
+            }
+        } break;
+    }
+}
+
+// append what comes after the last record; `any_records` tells whether a record was written
+void format_footer(const pool_t *pool, clags_sb_t *out, bool any_records)
+{
+    if (pool->format == Format_Sarif) sb_append_cstr(out, any_records ? "\n    ]\n  }]\n}\n" : "]\n  }]\n}\n");
+}
+
+void print_header(const pool_t *pool)
+{
+    clags_sb_t out = {0};
+    format_header(pool, &out);
+    (void) write_all(STDOUT_FILENO, out.items, out.count);
+    clags_sb_free(&out);
+}
+
+void print_footer(const pool_t *pool)
+{
+    clags_sb_t out = {0};
+    format_footer(pool, &out, output_records_written);
+    (void) write_all(STDOUT_FILENO, out.items, out.count);
+    clags_sb_free(&out);
+}
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    for (size_t i=0; i<size; ++i){
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ull
+
+// a reader over a serialized buffer that fails once it would read past the end
+typedef struct{
+    const char *data;
+    size_t size;
+    size_t offset;
+    bool failed;
+} reader_t;
+
+const void* reader_take(reader_t *reader, size_t size)
+{
+    if (reader->failed || reader->size - reader->offset < size){
+        reader->failed = true;
+        return NULL;
+    }
+    const void *data = reader->data+reader->offset;
+    reader->offset += size;
+    return data;
+}
+
+uint32_t reader_u32(reader_t *reader)
+{
+    uint32_t value = 0;
+    const void *data = reader_take(reader, sizeof(value));
+    if (data) memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+uint64_t reader_u64(reader_t *reader)
+{
+    uint64_t value = 0;
+    const void *data = reader_take(reader, sizeof(value));
+    if (data) memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+cache_entry_t* cache_find(cache_t *cache, const char *path, size_t path_len)
+{
+    if (cache->slot_count == 0) return NULL;
+    size_t slot = hash_bytes(HASH_SEED, path, path_len) & (cache->slot_count-1);
+    while (cache->slots[slot] != 0){
+        cache_entry_t *entry = &cache->entries[cache->slots[slot]-1];
+        if (entry->path_len == path_len && memcmp(entry->path, path, path_len) == 0) return entry;
+        slot = (slot+1) & (cache->slot_count-1);
+    }
+    return NULL;
+}
+
+cache_entry_t* cache_lookup(cache_t *cache, const char *path)
+{
+    return cache_find(cache, path, strlen(path));
+}
+
+// the fingerprint of everything the cached matches depend on
+uint64_t cache_fingerprint(const pool_t *pool)
+{
+    const matcher_t *matcher = pool->matcher;
+    uint64_t hash = hash_bytes(HASH_SEED, &pool->skip_binary, sizeof(pool->skip_binary));
+    hash = hash_bytes(hash, &pool->mode, sizeof(pool->mode));
+    hash = hash_bytes(hash, &pool->max_count, sizeof(pool->max_count));
+    hash = hash_bytes(hash, &pool->unpack, sizeof(pool->unpack));
+    hash = hash_bytes(hash, &pool->comments_only, sizeof(pool->comments_only));
+    hash = hash_bytes(hash, &matcher->ignore_case, sizeof(matcher->ignore_case));
+    hash = hash_bytes(hash, &matcher->words, sizeof(matcher->words));
+    for (size_t i=0; i<matcher->count; ++i){
+        hash = hash_bytes(hash, matcher->patterns[i], matcher->lengths[i]+1);
+    }
+    return hash;
+}
+
+// parse one serialized entry, written by `record_matches`
+bool cache_parse_entry(reader_t *reader, cache_entry_t *entry)
+{
+    size_t start = reader->offset;
+    entry->path_len = reader_u32(reader);
+    entry->path = reader_take(reader, entry->path_len);
+    entry->mtime_sec = (int64_t) reader_u64(reader);
+    entry->mtime_nsec = (int64_t) reader_u64(reader);
+    entry->size = reader_u64(reader);
+    entry->ino = reader_u64(reader);
+    entry->match_count = reader_u32(reader);
+    entry->matches = reader->data+reader->offset;
+    for (uint32_t j=0; j<entry->match_count && !reader->failed; ++j){
+        (void) reader_take(reader, 2*sizeof(uint64_t) + 7*sizeof(uint32_t));
+        uint32_t text_len = reader_u32(reader);
+        (void) reader_take(reader, text_len);
+    }
+    if (reader->failed) return false;
+    entry->record = reader->data+start;
+    entry->record_size = reader->offset-start;
+    return true;
+}
+
+bool cache_parse(cache_t *cache)
+{
+    reader_t reader = {.data=cache->blob, .size=cache->blob_size};
+    const char *magic = reader_take(&reader, 4);
+    if (magic == NULL || memcmp(magic, CACHE_MAGIC, 4) != 0) return false;
+    if (reader_u32(&reader) != CACHE_VERSION) return false;
+    // a cache made with other patterns is of no use
+    if (reader_u64(&reader) != cache->fingerprint) return true;
+    uint64_t count = reader_u64(&reader);
+    if (reader.failed || count > cache->blob_size) return false;
+
+    cache->entries = calloc(count > 0 ? count : 1, sizeof(*cache->entries));
+    cache->slot_count = 1;
+    while (cache->slot_count < count*2) cache->slot_count *= 2;
+    cache->slots = calloc(cache->slot_count, sizeof(*cache->slots));
+    assert(cache->entries != NULL && cache->slots != NULL && "Out of memory!");
+    for (uint64_t i=0; i<count; ++i){
+        cache_entry_t *entry = &cache->entries[i];
+        if (!cache_parse_entry(&reader, entry)) return false;
+        cache->entry_count++;
+        if (cache_find(cache, entry->path, entry->path_len) != NULL){
+            // drop duplicates, the first entry wins
+            entry->visited = true;
+            continue;
+        }
+        size_t slot = hash_bytes(HASH_SEED, entry->path, entry->path_len) & (cache->slot_count-1);
+        while (cache->slots[slot] != 0) slot = (slot+1) & (cache->slot_count-1);
+        cache->slots[slot] = i+1;
+    }
+    return true;
+}
+
+void cache_load(cache_t *cache, const char *path, uint64_t fingerprint)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->path = path;
+    cache->fingerprint = fingerprint;
+    cache->started = time(NULL);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1){
+        if (errno != ENOENT) fprintf(stderr, "[WARNING] Could not open cache '%s': %s!\n", path, strerror(errno));
+        return;
+    }
+    struct stat attr;
+    if (fstat(fd, &attr) == 0 && attr.st_size > 0){
+        void *blob = mmap(NULL, attr.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (blob != MAP_FAILED){
+            cache->blob = blob;
+            cache->blob_size = attr.st_size;
+        }
+    }
+    close(fd);
+    if (cache->blob != NULL && !cache_parse(cache)){
+        fprintf(stderr, "[WARNING] Ignoring malformed cache '%s'!\n", path);
+        free(cache->entries);
+        free(cache->slots);
+        cache->entries = NULL;
+        cache->slots = NULL;
+        cache->entry_count = cache->slot_count = 0;
+    }
+}
+
+// append the matches of an entry to `matches`; their texts point into the entry
+void cache_entry_matches(const cache_entry_t *entry, match_list_t *matches)
+{
+    reader_t reader = {.data=entry->matches, .size=entry->record+entry->record_size-entry->matches};
+    for (uint32_t i=0; i<entry->match_count; ++i){
+        match_t match = {0};
+        match.line = reader_u64(&reader);
+        match.column = reader_u64(&reader);
+        match.pattern = reader_u32(&reader);
+        match.indent = reader_u32(&reader);
+        match.owner = reader_u32(&reader);
+        match.owner_len = reader_u32(&reader);
+        match.ticket = reader_u32(&reader);
+        match.ticket_len = reader_u32(&reader);
+        match.priority = reader_u32(&reader);
+        match.text_len = reader_u32(&reader);
+        match.text = reader_take(&reader, match.text_len);
+        matches_append(matches, match);
+    }
+}
+
+// whether the file an entry was recorded from is unchanged
+bool cache_entry_current(const cache_entry_t *entry, const struct stat *attr)
+{
+    return entry->mtime_sec == (int64_t) attr->st_mtim.tv_sec && entry->mtime_nsec == (int64_t) attr->st_mtim.tv_nsec &&
+           entry->size == (uint64_t) attr->st_size && entry->ino == (uint64_t) attr->st_ino;
+}
+
+// replay the matches of an unchanged file; the match texts point into the cache
+bool cache_replay(cache_t *cache, worker_t *worker, const char *filename, const struct stat *attr)
+{
+    cache_entry_t *entry = cache_lookup(cache, filename);
+    if (entry == NULL || !cache_entry_current(entry, attr)) return false;
+    cache_entry_matches(entry, &worker->matches);
+    atomic_store_explicit(&entry->visited, true, memory_order_relaxed);
+    sb_append(&worker->cache_out, entry->record, entry->record_size);
+    worker->cache_out_count++;
+    return true;
+}
+
+// serialize the matches of a file, read back by `cache_parse_entry`
+void record_matches(clags_sb_t *out, const char *filename, const struct stat *attr, const match_list_t *matches)
+{
+    size_t path_len = strlen(filename);
+    sb_append_value(out, uint32_t, path_len);
+    sb_append(out, filename, path_len);
+    sb_append_value(out, int64_t, attr->st_mtim.tv_sec);
+    sb_append_value(out, int64_t, attr->st_mtim.tv_nsec);
+    sb_append_value(out, uint64_t, attr->st_size);
+    sb_append_value(out, uint64_t, attr->st_ino);
+    sb_append_value(out, uint32_t, matches->count);
+    for (size_t i=0; i<matches->count; ++i){
+        const match_t *match = &matches->items[i];
+        sb_append_value(out, uint64_t, match->line);
+        sb_append_value(out, uint64_t, match->column);
+        sb_append_value(out, uint32_t, match->pattern);
+        sb_append_value(out, uint32_t, match->indent);
+        sb_append_value(out, uint32_t, match->owner);
+        sb_append_value(out, uint32_t, match->owner_len);
+        sb_append_value(out, uint32_t, match->ticket);
+        sb_append_value(out, uint32_t, match->ticket_len);
+        sb_append_value(out, uint32_t, match->priority);
+        sb_append_value(out, uint32_t, match->text_len);
+        sb_append(out, match->text, match->text_len);
+    }
+}
+
+void cache_record(cache_t *cache, worker_t *worker, const char *filename, const struct stat *attr)
+{
+    cache_entry_t *entry = cache_lookup(cache, filename);
+    if (entry != NULL) atomic_store_explicit(&entry->visited, true, memory_order_relaxed);
+    // a file modified while the scan runs could change again within the same timestamp
+    if (attr->st_mtim.tv_sec >= cache->started) return;
+    record_matches(&worker->cache_out, filename, attr, &worker->matches);
+    worker->cache_out_count++;
+}
+
+// whether `path` is the normalized path `root` or below it
+bool path_under(const char *path, size_t path_len, const char *root)
+{
+    size_t root_len = strlen(root);
+    if (strcmp(root, ".") == 0){
+        return path_len > 0 && path[0] != '/' && !(path_len >= 2 && path[0] == '.' && path[1] == '.');
+    }
+    while (root_len > 1 && root[root_len-1] == '/') root_len--;
+    if (path_len < root_len || memcmp(path, root, root_len) != 0) return false;
+    return path_len == root_len || path[root_len] == '/' || root[root_len-1] == '/';
+}
+
+bool path_under_roots(const char *path, size_t path_len, clags_list_t roots)
+{
+    char root[FILENAME_MAX];
+    for (size_t i=0; i<roots.count; ++i){
+        cwk_path_normalize(clags_list_element(roots, char*, i), root, sizeof(root));
+        if (path_under(path, path_len, root)) return true;
+    }
+    return false;
+}
+
+// write the entries of this run, and the old entries outside of the searched paths, to a new cache file
+bool cache_save(cache_t *cache, pool_t *pool, clags_list_t roots)
+{
+    bool result = true;
+    uint64_t count = 0;
+    for (size_t i=0; i<pool->count; ++i) count += pool->workers[i].cache_out_count;
+    // after a scan stopped by --limit, the files that were not reached are kept
+    bool stopped = atomic_load(&pool->stop);
+    for (size_t i=0; i<cache->entry_count; ++i){
+        cache_entry_t *entry = &cache->entries[i];
+        if (entry->visited || (!stopped && path_under_roots(entry->path, entry->path_len, roots))){
+            entry->visited = true;
+        } else {
+            count++;
+        }
+    }
+
+    char tmp_path[FILENAME_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", cache->path, (long) getpid());
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL){
+        fprintf(stderr, "[ERROR] Could not write cache '%s': %s!\n", tmp_path, strerror(errno));
+        return false;
+    }
+    uint32_t version = CACHE_VERSION;
+    fwrite(CACHE_MAGIC, 1, 4, file);
+    fwrite(&version, sizeof(version), 1, file);
+    fwrite(&cache->fingerprint, sizeof(cache->fingerprint), 1, file);
+    fwrite(&count, sizeof(count), 1, file);
+    for (size_t i=0; i<pool->count; ++i){
+        clags_sb_t *out = &pool->workers[i].cache_out;
+        fwrite(out->items, 1, out->count, file);
+    }
+    for (size_t i=0; i<cache->entry_count; ++i){
+        cache_entry_t *entry = &cache->entries[i];
+        if (!entry->visited) fwrite(entry->record, 1, entry->record_size, file);
+    }
+    if (ferror(file)) result = false;
+    if (fclose(file) != 0) result = false;
+    if (result && rename(tmp_path, cache->path) == -1) result = false;
+    if (!result){
+        fprintf(stderr, "[ERROR] Could not write cache '%s': %s!\n", cache->path, strerror(errno));
+        (void) remove(tmp_path);
+    }
+    return result;
+}
+
+void cache_free(cache_t *cache)
+{
+    if (cache->blob) munmap(cache->blob, cache->blob_size);
+    free(cache->entries);
+    free(cache->slots);
+}
+
+// a monotonic clock in nanoseconds, for --stats
+uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+// charge the time since the last switch to the current phase and switch to `phase`; returns the previous phase
+phase_t stats_phase(worker_t *worker, phase_t phase)
+{
+    stats_t *stats = &worker->stats;
+    phase_t previous = stats->phase;
+    if (!worker->pool->stats) return previous;
+    uint64_t now = clock_ns();
+    stats->phase_ns[previous] += now - stats->phase_start;
+    stats->phase_start = now;
+    stats->phase = phase;
+    return previous;
+}
+
+// write output to stdout, dropping the separator before the first result; `output_lock` must be held
+void write_output(const char *data, size_t size, format_t format)
+{
+    if (size == 0) return;
+    size_t skip = format == Format_Sarif && !output_records_written;
+    output_records_written = true;
+    if (!write_all(STDOUT_FILENO, data+skip, size-skip) && errno != EPIPE){
+        fprintf(stderr, "[ERROR] Could not write output: %s!\n", strerror(errno));
+    }
+}
+
+// write the buffered output of a worker in one block; the buffer only ever holds whole files,
+// so results of concurrently searched files never interleave
+void flush_output(clags_sb_t *out, format_t format)
+{
+    if (out->count == 0) return;
+    pthread_mutex_lock(&output_lock);
+    write_output(out->items, out->count, format);
+    pthread_mutex_unlock(&output_lock);
+    out->count = 0;
+}
+
+// called after the output of a file is complete; batches the output unless it goes to a terminal.
+// with --sort the output stays with the worker until its slot is finished
+void finish_file(worker_t *worker)
+{
+    pool_t *pool = worker->pool;
+    if (!pool->sort && worker->out.count >= pool->flush_size) flush_output(&worker->out, pool->format);
+}
+
+// move the output of a slot to the spill file; false if it cannot be written there
+bool sorter_spill(sorter_t *sorter, slot_t *slot)
+{
+    if (sorter->spill == NULL) sorter->spill = tmpfile();
+    if (sorter->spill == NULL) return false;
+    int fd = fileno(sorter->spill);
+    for (size_t done=0; done<slot->out.count;){
+        ssize_t n = pwrite(fd, slot->out.items+done, slot->out.count-done, sorter->spill_size+done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    slot->spill_offset = sorter->spill_size;
+    slot->spill_size = slot->out.count;
+    sorter->spill_size += slot->out.count;
+    clags_sb_free(&slot->out);
+    return true;
+}
+
+// write the output of the slot at the cursor, from memory or from the spill file
+void sorter_write(pool_t *pool, slot_t *slot)
+{
+    sorter_t *sorter = &pool->sorter;
+    write_output(slot->out.items, slot->out.count, pool->format);
+    sorter->buffered -= slot->out.count;
+    clags_sb_free(&slot->out);
+    char chunk[READ_CHUNK_SIZE];
+    for (size_t done=0; done<slot->spill_size;){
+        size_t wanted = slot->spill_size-done < sizeof(chunk) ? slot->spill_size-done : sizeof(chunk);
+        ssize_t n = pread(fileno(sorter->spill), chunk, wanted, slot->spill_offset+done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0){
+            fprintf(stderr, "[ERROR] Could not read spilled output: %s!\n", n < 0 ? strerror(errno) : "unexpected end of file");
+            break;
+        }
+        write_output(chunk, n, pool->format);
+        done += n;
+    }
+}
+
+// write the ready slots at the cursor and move it past them, freeing the entries of the directories it leaves;
+// `output_lock` must be held
+void sorter_advance(pool_t *pool)
+{
+    sorter_t *sorter = &pool->sorter;
+    slot_t *slot = sorter->cursor;
+    while (slot != NULL && slot->ready){
+        if (slot->children != NULL){
+            slot = slot->children;
+            continue;
+        }
+        sorter_write(pool, slot);
+        while (slot != NULL && slot->next == NULL){
+            slot_t *parent = slot->parent;
+            // the roots live in the sorter's arena
+            if (parent != NULL && parent != &sorter->root){
+                free(parent->children);
+                parent->children = NULL;
+            }
+            slot = parent;
+        }
+        if (slot != NULL) slot = slot->next;
+    }
+    sorter->cursor = slot;
+}
+
+// hand the worker's output over to `slot`, which is complete now. the output is written right away if the cursor
+// is at the slot, and held back otherwise, in memory up to the budget and in the spill file beyond it.
+// whoever finishes the slot at the cursor writes what follows it, so no worker ever waits for another
+void slot_finish(worker_t *worker, slot_t *slot)
+{
+    pool_t *pool = worker->pool;
+    sorter_t *sorter = &pool->sorter;
+    pthread_mutex_lock(&output_lock);
+    if (slot == sorter->cursor){
+        write_output(worker->out.items, worker->out.count, pool->format);
+        worker->out.count = 0;
+    } else if (worker->out.count > 0){
+        slot->out = worker->out;
+        worker->out = (clags_sb_t){0};
+        // without a spill file the budget is exceeded rather than output lost
+        if (sorter->buffered + slot->out.count <= sorter->budget || !sorter_spill(sorter, slot)){
+            sorter->buffered += slot->out.count;
+        }
+    }
+    slot->ready = true;
+    sorter_advance(pool);
+    pthread_mutex_unlock(&output_lock);
+}
+
+// publish the entries of a directory; `children` is NULL for a directory without any
+void slot_expand(pool_t *pool, slot_t *slot, slot_t *children)
+{
+    pthread_mutex_lock(&output_lock);
+    slot->children = children;
+    slot->ready = true;
+    sorter_advance(pool);
+    pthread_mutex_unlock(&output_lock);
+}
+
+// grow the worker's read buffer to hold at least `size` bytes
+void buffer_reserve(worker_t *worker, size_t size)
+{
+    if (worker->buffer_capacity >= size) return;
+    size_t new_capacity = worker->buffer_capacity == 0 ? READ_CHUNK_SIZE : worker->buffer_capacity*2;
+    while (new_capacity < size) new_capacity *= 2;
+    worker->buffer = realloc(worker->buffer, new_capacity);
+    assert(worker->buffer != NULL && "Out of memory!");
+    worker->buffer_capacity = new_capacity;
+}
+
+// read a file into the worker's buffer until `limit` bytes are buffered, growing it as needed;
+// `size` holds the amount of bytes that were already read
+bool read_file(worker_t *worker, int fd, size_t size_hint, size_t limit, size_t *size)
+{
+    size_t count = *size;
+    while (count < limit){
+        if (worker->buffer_capacity < size_hint + 1 || worker->buffer_capacity == count){
+            buffer_reserve(worker, size_hint + 1 > count + 1 ? size_hint + 1 : count + 1);
+        }
+        size_t wanted = worker->buffer_capacity-count;
+        if (wanted > limit-count) wanted = limit-count;
+        ssize_t n = read(fd, worker->buffer+count, wanted);
+        if (n < 0){
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (n == 0) break;
+        count += n;
+    }
+    *size = count;
+    return true;
+}
+
+static inline bool pool_stopped(pool_t *pool)
+{
+    return atomic_load_explicit(&pool->stop, memory_order_relaxed);
+}
+
+// the most matches a file may report; `per_file` receives the limit without --limit, which may lower it
+size_t file_limit(pool_t *pool, size_t *per_file)
+{
+    size_t limit = pool->mode == Search_First ? 1 : pool->max_count > 0 ? pool->max_count : SIZE_MAX;
+    *per_file = limit;
+    if (pool->limit > 0){
+        size_t claimed = atomic_load_explicit(&pool->claimed, memory_order_relaxed);
+        size_t remaining = claimed < pool->limit ? pool->limit - claimed : 0;
+        if (remaining < limit) limit = remaining;
+    }
+    return limit;
+}
+
+// count the matches of a file against --limit, dropping those past it, and stop the scan once it is reached
+void claim_matches(worker_t *worker)
+{
+    pool_t *pool = worker->pool;
+    size_t count = worker->matches.count;
+    if (pool->limit == 0 || count == 0) return;
+    size_t before = atomic_fetch_add(&pool->claimed, count);
+    if (before >= pool->limit) worker->matches.count = 0;
+    else if (count > pool->limit - before) worker->matches.count = pool->limit - before;
+    if (before + count >= pool->limit) atomic_store(&pool->stop, true);
+}
+
+// search a file as it is read and stop reading at the first match, for --files-with-matches; the worker's buffer
+// holds `count` bytes that were already read and is reused as a window, so large files take no more memory.
+// `total` receives the amount of bytes read
+bool search_until_match(worker_t *worker, int fd, size_t count, size_t *total)
+{
+    const matcher_t *matcher = worker->pool->matcher;
+    size_t overlap = matcher->max_length-1;
+    *total = count;
+    while (true){
+        phase_t previous = stats_phase(worker, Phase_Match);
+        search_buffer(&worker->matches, worker->buffer, count, matcher, Search_First, 1);
+        stats_phase(worker, previous);
+        if (worker->matches.count > 0 || pool_stopped(worker->pool)) return true;
+        // keep the end of the window, a match may start in it; it is too short to hold a whole match
+        size_t keep = count > overlap ? overlap : count;
+        memmove(worker->buffer, worker->buffer+count-keep, keep);
+        count = keep;
+        if (!read_file(worker, fd, 0, keep+READ_CHUNK_SIZE, &count)) return false;
+        if (count == keep) return true;
+        *total += count-keep;
+    }
+}
+
+// guess from the start of a file whether it is binary: it contains a NUL byte, or too many control characters
+bool is_binary(const char *data, size_t size)
+{
+    if (size > BINARY_PROBE_SIZE) size = BINARY_PROBE_SIZE;
+    if (memchr(data, '\0', size) != NULL) return true;
+    size_t control = 0;
+    for (size_t i=0; i<size; ++i){
+        unsigned char c = data[i];
+        control += (c < 0x20 && c != '\t' && c != '\n' && c != '\r' && c != '\f' && c != '\v') || c == 0x7f;
+    }
+    return control*100 > size*BINARY_MAX_CONTROL_PERCENT;
+}
+
+// join a normalized directory path and a single entry name; equivalent to `cwk_path_join` for these inputs
+const char* join_path(const char *dirname, const char *name, char *buffer, size_t size)
+{
+    if (dirname == NULL) return name;
+    if (strcmp(dirname, ".") == 0){
+        snprintf(buffer, size, "%s", name);
+    } else {
+        size_t len = strlen(dirname);
+        snprintf(buffer, size, "%s%s%s", dirname, len > 0 && dirname[len-1] == '/' ? "" : "/", name);
+    }
+    return buffer;
+}
+
+// what a file read with --search-compressed is packed with
+typedef enum{
+    Packing_None,
+    Packing_Tar,
+    Packing_Gzip,
+    Packing_Zstd,
+    Packing_Xz,
+    Packing_Bzip2,
+} packing_t;
+
+// the programs that decompress each format to stdout
+static const char *const unpack_tools[] = {
+    [Packing_Gzip]="gzip",
+    [Packing_Zstd]="zstd",
+    [Packing_Xz]="xz",
+    [Packing_Bzip2]="bzip2",
+};
+
+#define TAR_BLOCK_SIZE 512
+
+// a packed file being read, through a decompressor unless it is a plain tar archive
+typedef struct{
+    int fd;           // the file itself or the pipe from the decompressor
+    pid_t pid;        // the decompressor, -1 for none
+    bool drained;     // everything was read, so the decompressor's exit status tells whether it succeeded
+} unpack_t;
+
+// recognize a packed file by its magic bytes
+packing_t detect_packing(const char *data, size_t size)
+{
+    if (size >= 3 && memcmp(data, "\x1f\x8b\x08", 3) == 0) return Packing_Gzip;
+    if (size >= 4 && memcmp(data, "\x28\xb5\x2f\xfd", 4) == 0) return Packing_Zstd;
+    if (size >= 6 && memcmp(data, "\xfd" "7zXZ\0", 6) == 0) return Packing_Xz;
+    if (size >= 10 && memcmp(data, "BZh", 3) == 0 && memcmp(data+4, "\x31\x41\x59\x26\x53\x59", 6) == 0) return Packing_Bzip2;
+    if (size >= TAR_BLOCK_SIZE && memcmp(data+257, "ustar", 5) == 0) return Packing_Tar;
+    return Packing_None;
+}
+
+// start reading the file `fd` from its start, decompressing it with the tool for `packing`
+bool unpack_open(unpack_t *in, int fd, packing_t packing, const char *filename)
+{
+    *in = (unpack_t){.fd=fd, .pid=-1};
+    if (lseek(fd, 0, SEEK_SET) == -1){
+        fprintf(stderr, "[ERROR] Could not read file '%s': %s!\n", filename, strerror(errno));
+        return false;
+    }
+    if (packing == Packing_Tar) return true;
+    const char *tool = unpack_tools[packing];
+    // other workers fork too, they must not keep the write end open
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1){
+        fprintf(stderr, "[ERROR] Could not run %s: %s!\n", tool, strerror(errno));
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == -1){
+        fprintf(stderr, "[ERROR] Could not run %s: %s!\n", tool, strerror(errno));
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return false;
+    }
+    if (pid == 0){
+        dup2(fd, STDIN_FILENO);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        execlp(tool, tool, "-dc", (char*) NULL);
+        // other workers may hold the stdio locks at the fork, `unpack_close` reports this from the exit status
+        _exit(127);
+    }
+    close(pipe_fds[1]);
+    in->fd = pipe_fds[0];
+    in->pid = pid;
+    return true;
+}
+
+// wait for the decompressor; false if it failed on a file that was read to its end
+bool unpack_close(unpack_t *in, packing_t packing, const char *filename)
+{
+    if (in->pid == -1) return true;
+    close(in->fd);
+    int status = 0;
+    while (waitpid(in->pid, &status, 0) == -1 && errno == EINTR);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127){
+        fprintf(stderr, "[ERROR] Could not run %s!\n", unpack_tools[packing]);
+        return false;
+    }
+    if (in->drained && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)){
+        fprintf(stderr, "[ERROR] Could not decompress '%s' with %s!\n", filename, unpack_tools[packing]);
+        return false;
+    }
+    return true;
+}
+
+// read up to `size` bytes, less only at the end of the stream; -1 on errors
+ssize_t unpack_read(unpack_t *in, char *data, size_t size)
+{
+    size_t count = 0;
+    while (count < size){
+        ssize_t n = read(in->fd, data+count, size-count);
+        if (n < 0){
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0){
+            in->drained = true;
+            break;
+        }
+        count += n;
+    }
+    return count;
+}
+
+// read past `size` bytes, in the worker's buffer
+bool unpack_skip(worker_t *worker, unpack_t *in, uint64_t size)
+{
+    if (in->pid == -1 && lseek(in->fd, size, SEEK_CUR) != -1) return true;
+    buffer_reserve(worker, READ_CHUNK_SIZE);
+    while (size > 0){
+        size_t wanted = size < READ_CHUNK_SIZE ? size : READ_CHUNK_SIZE;
+        ssize_t n = unpack_read(in, worker->buffer, wanted);
+        if (n < (ssize_t) wanted) return false;
+        size -= n;
+    }
+    return true;
+}
+
+size_t count_lines(const char *data, size_t size)
+{
+    size_t lines = 0;
+    const char *end = data+size;
+    while ((data = memchr(data, '\n', end-data)) != NULL){
+        lines++;
+        data++;
+    }
+    return lines;
+}
+
+// search the next `size` bytes of a packed file (UINT64_MAX for the rest of it) as the file `filename`.
+// the worker's buffer holds the lines not searched yet, starting with `count` bytes that were already read;
+// it is filled READ_CHUNK_SIZE at a time and searched up to its last newline, so memory stays bounded.
+// lines longer than MMAP_THRESHOLD are searched in pieces. `language` is the one of the unpacked file, for
+// --comments-only. `total` receives the amount of bytes searched
+bool search_stream(worker_t *worker, unpack_t *in, uint64_t size, size_t count, const char *filename, language_t language, uint64_t *total)
+{
+    pool_t *pool = worker->pool;
+    const matcher_t *matcher = pool->matcher;
+    bool lines_mode = pool->mode == Search_Lines;
+    size_t overlap = matcher->max_length-1;
+    worker->matches.count = 0;
+    uint64_t left = size == UINT64_MAX ? UINT64_MAX : size-count;
+    size_t lines = 0;        // before the buffer
+    size_t column = 0;       // of the buffer's start, within a line that is searched in pieces
+    size_t printed = 0;      // matches already printed, with lines
+    bool probed = !pool->skip_binary;
+    lexer_t lexer;
+    lexer_t *comments = NULL;
+    if (pool->comments_only && language != Language_None){
+        lexer_init(&lexer, language);
+        comments = &lexer;
+    }
+    bool end = false;
+    while (!end){
+        size_t wanted = left < READ_CHUNK_SIZE ? left : READ_CHUNK_SIZE;
+        buffer_reserve(worker, count+wanted+1);
+        ssize_t n = unpack_read(in, worker->buffer+count, wanted);
+        if (n < 0) return false;
+        if (left != UINT64_MAX) left -= n;
+        count += n;
+        end = (size_t) n < wanted || left == 0;
+        if (!probed){
+            probed = true;
+            if (is_binary(worker->buffer, count)) break;
+        }
+        size_t region = count;
+        if (!end){
+            const char *newline = memrchr(worker->buffer, '\n', count);
+            region = newline != NULL ? (size_t) (newline-worker->buffer+1) : 0;
+            // the kept end is too short to hold a whole match, one that starts before the cut is found in this piece
+            if (region == 0 && count >= MMAP_THRESHOLD) region = count-overlap;
+        }
+        size_t per_file;
+        size_t limit = file_limit(pool, &per_file);
+        if (limit > per_file-printed) limit = per_file-printed;
+        size_t before = worker->matches.count;
+        phase_t previous = stats_phase(worker, Phase_Match);
+        search_range(&worker->matches, worker->buffer, count, 0, region, matcher, pool->mode, limit, comments);
+        if (comments != NULL){
+            // the lexer goes on where the next region starts
+            lexer_advance(comments, worker->buffer, count, region);
+            comments->offset -= region;
+        }
+        if (lines_mode){
+            for (size_t i=before; i<worker->matches.count; ++i){
+                match_t *match = &worker->matches.items[i];
+                if (match->line == 1) match->column += column;
+                match->line += lines;
+            }
+            lines += count_lines(worker->buffer, region);
+        }
+        stats_phase(worker, previous);
+        *total += region;
+        bool full = worker->matches.count >= limit;
+        // the matches point into the buffer, they are printed before it moves
+        if (lines_mode && worker->matches.count > 0){
+            claim_matches(worker);
+            worker->stats.matches += worker->matches.count;
+            printed += worker->matches.count;
+            print_matches(worker, filename, Change_None);
+            finish_file(worker);
+            worker->matches.count = 0;
+        }
+        if (region > 0) column = worker->buffer[region-1] != '\n' ? column+region : 0;
+        memmove(worker->buffer, worker->buffer+region, count-region);
+        count -= region;
+        if (full || pool_stopped(pool)) break;
+    }
+    // the rest of an archive entry is read past, the rest of a compressed file is dropped with the decompressor
+    if (!end && size != UINT64_MAX && !unpack_skip(worker, in, left)) return false;
+    claim_matches(worker);
+    worker->stats.matches += worker->matches.count;
+    if (worker->matches.count > 0) print_matches(worker, filename, Change_None);
+    finish_file(worker);
+    worker->matches.count = 0;
+    return true;
+}
+
+// a number field of a tar header: octal, or base-256 with the high bit set
+uint64_t tar_number(const char *field, size_t size)
+{
+    const unsigned char *p = (const unsigned char*) field;
+    uint64_t value = 0;
+    if (*p & 0x80){
+        value = *p & 0x3f;
+        for (size_t i=1; i<size; ++i) value = value << 8 | p[i];
+        return value;
+    }
+    size_t i = 0;
+    while (i < size && (p[i] == ' ' || p[i] == '\0')) ++i;
+    for (; i < size && p[i] >= '0' && p[i] <= '7'; ++i) value = value*8 + (p[i]-'0');
+    return value;
+}
+
+// read the data of a long name entry, GNU or pax, into `name`
+bool tar_long_name(worker_t *worker, unpack_t *in, char type, uint64_t size, char *name, size_t name_size)
+{
+    uint64_t padded = (size+TAR_BLOCK_SIZE-1)/TAR_BLOCK_SIZE*TAR_BLOCK_SIZE;
+    if (size > MMAP_THRESHOLD) return unpack_skip(worker, in, padded);
+    buffer_reserve(worker, padded+1);
+    if (unpack_read(in, worker->buffer, padded) < (ssize_t) padded) return false;
+    worker->buffer[padded] = '\0';
+    const char *data = worker->buffer;
+    const char *end = data+size;
+    if (type == 'L'){
+        size_t len = strnlen(data, size);
+        snprintf(name, name_size, "%.*s", (int) len, data);
+        return true;
+    }
+    // pax records are "<length> <key>=<value>\n"
+    while (data < end){
+        char *space;
+        unsigned long len = strtoul(data, &space, 10);
+        if (len == 0 || space >= end || *space != ' ' || len > (size_t) (end-data)) break;
+        const char *key = space+1;
+        const char *record_end = data+len;
+        if (record_end-key > 5 && memcmp(key, "path=", 5) == 0){
+            snprintf(name, name_size, "%.*s", (int) (record_end-key-6), key+5);
+        }
+        data = record_end;
+    }
+    return true;
+}
+
+// search every regular file of a tar archive, whose first header is in `header`;
+// each is reported as `archive:inner/path`. false if the archive is truncated or cannot be read
+bool search_tar(worker_t *worker, unpack_t *in, const char *archive, char *header, uint64_t *total)
+{
+    char name[FILENAME_MAX] = {0};   // set by a long name entry for the entry after it
+    char filename[2*FILENAME_MAX];
+    while (!pool_stopped(worker->pool)){
+        bool empty = true;
+        for (size_t i=0; i<TAR_BLOCK_SIZE && empty; ++i) empty = header[i] == '\0';
+        if (empty) return true;
+        uint64_t size = tar_number(header+124, 12);
+        uint64_t padding = (TAR_BLOCK_SIZE - size%TAR_BLOCK_SIZE)%TAR_BLOCK_SIZE;
+        char type = header[156];
+        bool ok;
+        if (type == 'L' || type == 'x'){
+            ok = tar_long_name(worker, in, type, size, name, sizeof(name));
+        } else {
+            if (type == '0' || type == '\0' || type == '7'){
+                if (*name == '\0'){
+                    // only POSIX archives split long names into a prefix
+                    bool posix = memcmp(header+257, "ustar\0", 6) == 0 && header[345] != '\0';
+                    snprintf(name, sizeof(name), "%.*s%s%.*s", posix ? (int) strnlen(header+345, 155) : 0, header+345,
+                             posix ? "/" : "", (int) strnlen(header, 100), header);
+                }
+                snprintf(filename, sizeof(filename), "%s:%s", archive, name);
+                ok = search_stream(worker, in, size, 0, filename, language_of(name), total) && unpack_skip(worker, in, padding);
+            } else {
+                ok = unpack_skip(worker, in, size+padding);
+            }
+            if (type != 'g' && type != 'K') *name = '\0';
+        }
+        if (!ok || unpack_read(in, header, TAR_BLOCK_SIZE) < TAR_BLOCK_SIZE) return false;
+    }
+    return true;
+}
+
+// search a file packed with `packing`, for --search-compressed; a compressed tar archive is searched as one.
+// `total` receives the amount of unpacked bytes searched
+bool search_packed(worker_t *worker, int fd, packing_t packing, const char *filename, uint64_t *total)
+{
+    unpack_t in;
+    if (!unpack_open(&in, fd, packing, filename)) return false;
+    char header[TAR_BLOCK_SIZE];
+    ssize_t n = unpack_read(&in, header, sizeof(header));
+    bool ok = n >= 0;
+    if (ok && detect_packing(header, n) == Packing_Tar){
+        ok = search_tar(worker, &in, filename, header, total);
+        if (!ok) fprintf(stderr, "[ERROR] Could not read archive '%s': it is truncated or corrupt!\n", filename);
+    } else {
+        if (ok){
+            buffer_reserve(worker, n+1);
+            memcpy(worker->buffer, header, n);
+            // a compressed file has the language of its name without the compression's extension
+            char stem[FILENAME_MAX];
+            const char *extension;
+            size_t length;
+            snprintf(stem, sizeof(stem), "%s", filename);
+            if (cwk_path_get_extension(stem, &extension, &length)) stem[extension-stem] = '\0';
+            ok = search_stream(worker, &in, UINT64_MAX, n, filename, language_of(stem), total);
+        }
+        if (!ok) fprintf(stderr, "[ERROR] Could not read file '%s': %s!\n", filename, strerror(errno));
+    }
+    if (!unpack_close(&in, packing, filename)) ok = false;
+    return ok;
+}
+
+void pool_submit(worker_t *worker, task_t task);
+
+void split_release(split_t *split)
+{
+    if (atomic_fetch_sub(&split->refs, 1) != 1) return;
+    pthread_mutex_destroy(&split->lock);
+    pthread_cond_destroy(&split->cond);
+    free(split->chunks);
+    free(split);
+}
+
+// search chunks of a split file until all are claimed; once the scan is stopped they are only claimed
+void split_help(worker_t *worker, split_t *split)
+{
+    const matcher_t *matcher = worker->pool->matcher;
+    size_t i;
+    while ((i = atomic_fetch_add(&split->next, 1)) < split->chunk_count){
+        if (!pool_stopped(worker->pool)){
+            split_chunk_t *chunk = &split->chunks[i];
+            size_t from = i*SPLIT_CHUNK_SIZE;
+            size_t to = split->size-from < SPLIT_CHUNK_SIZE ? split->size : from+SPLIT_CHUNK_SIZE;
+            phase_t previous = stats_phase(worker, Phase_Match);
+            search_range(&chunk->matches, split->data, split->size, from, to, matcher, split->mode, split->limit, NULL);
+            if (split->mode == Search_Lines) chunk->lines = count_lines(split->data+from, to-from);
+            stats_phase(worker, previous);
+        }
+        if (atomic_fetch_add(&split->done, 1)+1 == split->chunk_count){
+            pthread_mutex_lock(&split->lock);
+            pthread_cond_broadcast(&split->cond);
+            pthread_mutex_unlock(&split->lock);
+        }
+    }
+}
+
+// search a large file in chunks of SPLIT_CHUNK_SIZE, with the other workers helping, and merge their matches
+// into the worker's in order. a chunk's line numbers count from its start, the lines of the chunks before it
+// are added to them; its first line may have started in the chunk before, which is where its text is taken from
+void search_split(worker_t *worker, const char *data, size_t size, size_t limit)
+{
+    pool_t *pool = worker->pool;
+    split_t *split = calloc(1, sizeof(*split));
+    assert(split != NULL && "Out of memory!");
+    split->data = data;
+    split->size = size;
+    split->chunk_count = (size+SPLIT_CHUNK_SIZE-1)/SPLIT_CHUNK_SIZE;
+    split->chunks = calloc(split->chunk_count, sizeof(*split->chunks));
+    assert(split->chunks != NULL && "Out of memory!");
+    for (size_t i=0; i<split->chunk_count; ++i) split->chunks[i].matches.arena = &split->chunks[i].arena;
+    split->mode = pool->mode;
+    split->limit = limit;
+    pthread_mutex_init(&split->lock, NULL);
+    pthread_cond_init(&split->cond, NULL);
+    size_t helpers = split->chunk_count-1 < pool->count-1 ? split->chunk_count-1 : pool->count-1;
+    atomic_store(&split->refs, helpers+1);
+    for (size_t i=0; i<helpers; ++i) pool_submit(worker, (task_t){.kind=Task_Split, .split=split});
+    split_help(worker, split);
+    // the remaining chunks were claimed by helpers that are still searching them
+    pthread_mutex_lock(&split->lock);
+    while (atomic_load(&split->done) < split->chunk_count) pthread_cond_wait(&split->cond, &split->lock);
+    pthread_mutex_unlock(&split->lock);
+
+    size_t lines = 0;
+    for (size_t i=0; i<split->chunk_count; ++i){
+        split_chunk_t *chunk = &split->chunks[i];
+        size_t from = i*SPLIT_CHUNK_SIZE;
+        const char *newline = i > 0 ? memrchr(data, '\n', from) : NULL;
+        size_t line_start = newline != NULL ? (size_t) (newline-data+1) : 0;
+        for (size_t j=0; j<chunk->matches.count && worker->matches.count<limit; ++j){
+            match_t match = chunk->matches.items[j];
+            if (split->mode == Search_Lines){
+                if (match.line == 1 && line_start < from){
+                    const char *line = data+line_start;
+                    const char *line_end = match.text+match.text_len;
+                    const char *trimmed = skip_spaces(line, line_end);
+                    // the fields are offsets into the text, which now starts earlier
+                    match.owner += match.text-trimmed;
+                    match.ticket += match.text-trimmed;
+                    match.column += from-line_start;
+                    match.indent = trimmed-line;
+                    match.text = trimmed;
+                    match.text_len = line_end-trimmed;
+                }
+                match.line += lines;
+            }
+            matches_append(&worker->matches, match);
+        }
+        lines += chunk->lines;
+        arena_free(&chunk->arena);
+    }
+    split_release(split);
+}
+
+uint64_t file_id_hash(file_id_t id)
+{
+    return hash_bytes(hash_bytes(HASH_SEED, &id.dev, sizeof(id.dev)), &id.ino, sizeof(id.ino));
+}
+
+// record the file or directory behind `attr` as visited; false if it already was during this run
+bool visit(pool_t *pool, const struct stat *attr)
+{
+    file_id_t id = {.dev=attr->st_dev, .ino=attr->st_ino};
+    // cannot be told apart from an empty slot, and is not a real file anyway
+    if (id.dev == 0 && id.ino == 0) return true;
+    uint64_t hash = file_id_hash(id);
+    visited_shard_t *shard = &pool->visited[(hash >> 32)%VISITED_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    if ((shard->count+1)*2 > shard->capacity){
+        size_t capacity = shard->capacity == 0 ? MATCHES_INIT_CAPACITY : shard->capacity*2;
+        file_id_t *items = calloc(capacity, sizeof(*items));
+        assert(items != NULL && "Out of memory!");
+        for (size_t i=0; i<shard->capacity; ++i){
+            file_id_t item = shard->items[i];
+            if (item.dev == 0 && item.ino == 0) continue;
+            size_t slot = file_id_hash(item) & (capacity-1);
+            while (items[slot].dev != 0 || items[slot].ino != 0) slot = (slot+1) & (capacity-1);
+            items[slot] = item;
+        }
+        free(shard->items);
+        shard->items = items;
+        shard->capacity = capacity;
+    }
+    size_t slot = hash & (shard->capacity-1);
+    bool first = true;
+    while (shard->items[slot].dev != 0 || shard->items[slot].ino != 0){
+        if (shard->items[slot].dev == id.dev && shard->items[slot].ino == id.ino){
+            first = false;
+            break;
+        }
+        slot = (slot+1) & (shard->capacity-1);
+    }
+    if (first){
+        shard->items[slot] = id;
+        shard->count += 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return first;
+}
+
+// forget what was visited, before the next run
+void visited_clear(pool_t *pool)
+{
+    for (size_t i=0; i<VISITED_SHARDS; ++i){
+        free(pool->visited[i].items);
+        pool->visited[i].items = NULL;
+        pool->visited[i].count = 0;
+        pool->visited[i].capacity = 0;
+    }
+}
+
+// whether a file is searched for the first time during this run, like directories are. files given as roots
+// count too, so a root that is also found below another root, or is given twice, is searched once
+bool first_visit(worker_t *worker, const struct stat *attr)
+{
+    pool_t *pool = worker->pool;
+    if (pool->revisit || visit(pool, attr)) return true;
+    worker->stats.duplicates += 1;
+    return false;
+}
+
+// search the file `name` within the directory `dir_fd`; `dirname` is only used to build the path for output,
+// it is NULL for files given on the command line. `known` holds the file's stat, if the caller already has it,
+// and `prefetch` the file opened and read ahead by `prefetch_run`; the file descriptor is owned by the call
+int search_file(worker_t *worker, int dir_fd, const char *dirname, const char *name, const struct stat *known, const prefetch_t *prefetch)
+{
+    int result = 0;
+    pool_t *pool = worker->pool;
+    const matcher_t *matcher = pool->matcher;
+    cache_t *cache = pool->cache;
+    const char *filename = NULL;
+    struct stat attr;
+    if (known != NULL) attr = *known;
+    arena_reset(&worker->file_arena);
+    worker->matches = (match_list_t){.arena=&worker->file_arena};
+    int fd = prefetch != NULL ? prefetch->fd : -1;
+    if (cache != NULL){
+        filename = join_path(dirname, name, worker->path, sizeof(worker->path));
+        worker->stats.stats += known == NULL;
+        if (known == NULL && (fd != -1 ? fstat(fd, &attr) : fstatat(dir_fd, name, &attr, 0)) == -1){
+            fprintf(stderr, "[ERROR] Could not access '%s': %s!\n", filename, strerror(errno));
+            if (fd != -1) close(fd);
+            return 1;
+        }
+        known = &attr;
+        if (!first_visit(worker, &attr)){
+            if (fd != -1) close(fd);
+            return 0;
+        }
+        if (cache_replay(cache, worker, filename, &attr)){
+            worker->stats.files += 1;
+            worker->stats.bytes_skipped += attr.st_size;
+            claim_matches(worker);
+            worker->stats.matches += worker->matches.count;
+            if (pool->index) record_matches(&worker->index_out, filename, &attr, &worker->matches);
+            if (!pool->quiet) print_matches(worker, filename, Change_None);
+            finish_file(worker);
+            if (fd != -1) close(fd);
+            return 0;
+        }
+    }
+
+    if (prefetch == NULL) fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    else if (fd == -1) errno = prefetch->error;
+    // files listed by git may have been deleted since, roots that do not exist are skipped the same way
+    if (fd == -1 && dirname == NULL && errno == ENOENT) return 0;
+    if (fd == -1){
+        fprintf(stderr, "[ERROR] Could not open file '%s': %s!\n", join_path(dirname, name, worker->path, sizeof(worker->path)), strerror(errno));
+        return 1;
+    }
+    worker->stats.stats += known == NULL;
+    if (known == NULL && fstat(fd, &attr) == -1){
+        fprintf(stderr, "[ERROR] Could not access '%s': %s!\n", join_path(dirname, name, worker->path, sizeof(worker->path)), strerror(errno));
+        close(fd);
+        return 1;
+    }
+    if (cache == NULL && !first_visit(worker, &attr)){
+        close(fd);
+        return 0;
+    }
+    size_t size = attr.st_size;
+    void *mapped = NULL;
+    const char *data = NULL;
+    bool searched = false;
+    packing_t packing = Packing_None;
+    uint64_t unpacked = 0;
+    size_t per_file;
+    size_t limit = file_limit(pool, &per_file);
+    lexer_t lexer;
+    lexer_t *comments = NULL;
+    language_t language = pool->comments_only ? language_of(name) : Language_None;
+    if (language != Language_None){
+        lexer_init(&lexer, language);
+        comments = &lexer;
+    }
+    // a file searched for comments is not read up to its first match, the lexer needs it from the start
+    bool first_only = pool->mode == Search_First && comments == NULL;
+    if (size >= MMAP_THRESHOLD && !first_only){
+        mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED){
+            (void) madvise(mapped, size, MADV_SEQUENTIAL);
+            data = mapped;
+        } else {
+            mapped = NULL;
+        }
+    }
+    bool read_ahead = prefetch != NULL && prefetch->data != NULL;
+    if (data == NULL && read_ahead && prefetch->count >= size && prefetch->count < PREFETCH_SIZE){
+        // the whole file was read ahead, it is probed for binary content below like a mapped one
+        data = prefetch->data;
+        size = prefetch->count;
+    }
+    // small files, and files that cannot be mapped, are read in one go, after probing their start for binary content
+    if (data == NULL){
+        size_t count = 0;
+        // with --files-with-matches files are read in chunks, there is no point in making room for all of them
+        size_t hint = first_only ? 0 : size;
+        if (read_ahead && lseek(fd, prefetch->count, SEEK_SET) != -1){
+            buffer_reserve(worker, (hint > prefetch->count ? hint : prefetch->count) + 1);
+            memcpy(worker->buffer, prefetch->data, prefetch->count);
+            count = prefetch->count;
+        }
+        size_t limit = pool->skip_binary ? BINARY_PROBE_SIZE : first_only ? READ_CHUNK_SIZE : SIZE_MAX;
+        bool ok = read_file(worker, fd, hint, limit, &count);
+        if (ok && pool->unpack && (packing = detect_packing(worker->buffer, count)) != Packing_None) goto unpack;
+        if (ok && pool->skip_binary && is_binary(worker->buffer, count)) goto done;
+        if (ok && first_only){
+            ok = search_until_match(worker, fd, count, &size);
+            searched = ok;
+            if (ok) goto done;
+        }
+        if (ok) ok = read_file(worker, fd, size, SIZE_MAX, &count);
+        if (!ok){
+            fprintf(stderr, "[ERROR] Could not read file '%s': %s!\n", join_path(dirname, name, worker->path, sizeof(worker->path)), strerror(errno));
+            return_defer(1);
+        }
+        data = worker->buffer;
+        size = count;
+    } else if (pool->unpack && (packing = detect_packing(data, size)) != Packing_None){
+        goto unpack;
+    } else if (pool->skip_binary && is_binary(data, size)){
+        goto done;
+    }
+    if (mapped != NULL && comments == NULL && pool->split_size > 0 && size > pool->split_size && pool->count > 1){
+        search_split(worker, data, size, limit);
+    } else {
+        phase_t previous = stats_phase(worker, Phase_Match);
+        search_range(&worker->matches, data, size, 0, size, matcher, pool->mode, limit, comments);
+        stats_phase(worker, previous);
+    }
+    searched = true;
+unpack:
+    // packed files print their matches as they are found, and are not cached
+    if (packing != Packing_None){
+        if (filename == NULL) filename = join_path(dirname, name, worker->path, sizeof(worker->path));
+        if (!search_packed(worker, fd, packing, filename, &unpacked)) result = 1;
+        worker->stats.bytes_read += unpacked;
+        worker->matches.count = 0;
+        cache = NULL;
+    }
+done:
+    worker->stats.files += 1;
+    if (searched) worker->stats.bytes_read += size;
+    else if (packing == Packing_None) worker->stats.bytes_skipped += attr.st_size;
+    // a file cut short by --limit is searched again next time
+    if (cache != NULL && limit == per_file) cache_record(cache, worker, filename, &attr);
+    claim_matches(worker);
+    worker->stats.matches += worker->matches.count;
+    if (filename == NULL && (pool->index || worker->matches.count > 0)){
+        filename = join_path(dirname, name, worker->path, sizeof(worker->path));
+    }
+    if (pool->index) record_matches(&worker->index_out, filename, &attr, &worker->matches);
+    if (worker->matches.count > 0 && !pool->quiet){
+        // context lines are sliced from the contents while they are still mapped or buffered
+        worker->file_data = searched ? data : NULL;
+        worker->file_size = size;
+        worker->line_count = 0;
+        worker->lines_complete = false;
+        print_matches(worker, filename, Change_None);
+        worker->file_data = NULL;
+    }
+
+defer:
+    if (mapped != NULL) munmap(mapped, attr.st_size);
+    close(fd);
+    finish_file(worker);
+    return result;
+}
+
+bool glob_match(const char *p, const char *pend, const char *t, const char *tend);
+
+// match a bracket expression like `[a-z]` or `[!0-9]` at `p`; returns the end of the expression or NULL if it is unterminated
+const char* glob_class(const char *p, const char *pend, char c, bool *matched)
+{
+    p++;
+    bool negated = p < pend && (*p == '!' || *p == '^');
+    if (negated) p++;
+    bool found = false;
+    const char *start = p;
+    while (p < pend && (*p != ']' || p == start)){
+        char low = *p;
+        if (low == '\\' && p+1 < pend) low = *++p;
+        char high = low;
+        if (p+2 < pend && p[1] == '-' && p[2] != ']'){
+            p += 2;
+            high = *p;
+            if (high == '\\' && p+1 < pend) high = *++p;
+        }
+        if ((unsigned char)c >= (unsigned char)low && (unsigned char)c <= (unsigned char)high) found = true;
+        p++;
+    }
+    if (p >= pend) return NULL;
+    *matched = found != negated;
+    return p+1;
+}
+
+// match a gitignore-style glob; `*` and `?` never match `/`, while `**` spans whole path components
+bool glob_match(const char *p, const char *pend, const char *t, const char *tend)
+{
+    const char *pstart = p;
+    while (p < pend){
+        switch (*p){
+            case '*': {
+                bool component_start = p == pstart || p[-1] == '/';
+                if (p+1 < pend && p[1] == '*' && component_start && (p+2 == pend || p[2] == '/')){
+                    if (p+2 == pend) return true;
+                    // `**/` matches zero or more directories
+                    for (const char *q=t; ; ++q){
+                        if (glob_match(p+3, pend, q, tend)) return true;
+                        q = memchr(q, '/', tend-q);
+                        if (q == NULL) return false;
+                    }
+                }
+                while (p < pend && *p == '*') p++;
+                for (const char *q=t; ; ++q){
+                    if (glob_match(p, pend, q, tend)) return true;
+                    if (q == tend || *q == '/') return false;
+                }
+            }
+            case '?': {
+                if (t == tend || *t == '/') return false;
+                p++;
+                t++;
+            } break;
+            case '[': {
+                bool matched = false;
+                const char *next = t < tend ? glob_class(p, pend, *t, &matched) : NULL;
+                if (next == NULL){
+                    // an unterminated class is a literal '['
+                    if (t == tend || *t != '[') return false;
+                    p++;
+                } else {
+                    if (!matched || *t == '/') return false;
+                    p = next;
+                }
+                t++;
+            } break;
+            case '\\': {
+                if (p+1 < pend) p++;
+            } // fall through
+            default: {
+                if (t == tend || *t != *p) return false;
+                p++;
+                t++;
+            } break;
+        }
+    }
+    return t == tend;
+}
+
+bool has_wildcards(const char *s, size_t len)
+{
+    for (size_t i=0; i<len; ++i){
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\') return true;
+    }
+    return false;
+}
+
+// parse one gitignore line in place; returns false for blank lines and comments
+bool ignore_parse_rule(char *line, ignore_rule_t *rule)
+{
+    size_t len = strlen(line);
+    if (len > 0 && line[len-1] == '\r') line[--len] = '\0';
+    while (len > 0 && line[len-1] == ' ' && !(len > 1 && line[len-2] == '\\')) line[--len] = '\0';
+    if (len == 0 || line[0] == '#') return false;
+    memset(rule, 0, sizeof(*rule));
+    rule->next = -1;
+    if (line[0] == '!'){
+        rule->negated = true;
+        line++;
+        len--;
+    } else if (line[0] == '\\' && (line[1] == '#' || line[1] == '!')){
+        line++;
+        len--;
+    }
+    if (len > 0 && line[len-1] == '/'){
+        rule->dir_only = true;
+        line[--len] = '\0';
+    }
+    if (len == 0) return false;
+    rule->anchored = memchr(line, '/', len) != NULL;
+    if (line[0] == '/'){
+        line++;
+        len--;
+    }
+    if (len == 0) return false;
+    rule->pattern = line;
+    rule->len = len;
+    if (!rule->anchored && !has_wildcards(line, len)){
+        rule->kind = Rule_Literal;
+    } else if (!rule->anchored && line[0] == '*' && len > 2 && line[1] == '.' && !has_wildcards(line+1, len-1)){
+        rule->kind = Rule_Extension;
+    } else {
+        rule->kind = Rule_Glob;
+    }
+    return true;
+}
+
+// the hash index of literal names and extensions; rules with the same key are chained from the highest index down
+void ignore_index(ignore_t *ignore)
+{
+    ignore->slot_count = 1;
+    while (ignore->slot_count < ignore->count*2) ignore->slot_count *= 2;
+    ignore->slots = calloc(ignore->slot_count, sizeof(*ignore->slots));
+    ignore->globs = malloc((ignore->count > 0 ? ignore->count : 1)*sizeof(*ignore->globs));
+    assert(ignore->slots != NULL && ignore->globs != NULL && "Out of memory!");
+    for (size_t i=0; i<ignore->count; ++i){
+        ignore_rule_t *rule = &ignore->rules[i];
+        if (rule->anchored) ignore->has_anchored = true;
+        if (rule->kind == Rule_Glob) continue;
+        const char *key = rule->kind == Rule_Extension ? rule->pattern+1 : rule->pattern;
+        size_t key_len = rule->kind == Rule_Extension ? rule->len-1 : rule->len;
+        size_t slot = hash_bytes(HASH_SEED ^ rule->kind, key, key_len) & (ignore->slot_count-1);
+        while (ignore->slots[slot].key != NULL){
+            rule_slot_t *s = &ignore->slots[slot];
+            if (s->kind == rule->kind && s->key_len == key_len && memcmp(s->key, key, key_len) == 0) break;
+            slot = (slot+1) & (ignore->slot_count-1);
+        }
+        rule_slot_t *s = &ignore->slots[slot];
+        if (s->key == NULL){
+            *s = (rule_slot_t){.key=key, .key_len=key_len, .kind=rule->kind, .first=-1};
+        }
+        rule->next = s->first;
+        s->first = i;
+    }
+    for (size_t i=ignore->count; i-- > 0;){
+        if (ignore->rules[i].kind == Rule_Glob) ignore->globs[ignore->glob_count++] = i;
+    }
+}
+
+const rule_slot_t* ignore_slot(const ignore_t *ignore, rule_kind_t kind, const char *key, size_t key_len)
+{
+    size_t slot = hash_bytes(HASH_SEED ^ kind, key, key_len) & (ignore->slot_count-1);
+    while (ignore->slots[slot].key != NULL){
+        const rule_slot_t *s = &ignore->slots[slot];
+        if (s->kind == kind && s->key_len == key_len && memcmp(s->key, key, key_len) == 0) return s;
+        slot = (slot+1) & (ignore->slot_count-1);
+    }
+    return NULL;
+}
+
+// the highest rule of a chain that applies to the entry, or -1
+int32_t ignore_chain(const ignore_t *ignore, const rule_slot_t *slot, bool is_dir)
+{
+    if (slot == NULL) return -1;
+    for (int32_t i=slot->first; i>=0; i=ignore->rules[i].next){
+        if (!ignore->rules[i].dir_only || is_dir) return i;
+    }
+    return -1;
+}
+
+// decide an entry by the rules of one ignore file: 1 if ignored, 0 if re-included, -1 if no rule applies
+int ignore_decide(const ignore_t *ignore, const char *dirname, const char *name, bool is_dir)
+{
+    size_t name_len = strlen(name);
+    int32_t best = ignore_chain(ignore, ignore_slot(ignore, Rule_Literal, name, name_len), is_dir);
+    for (const char *dot = strchr(name, '.'); dot != NULL; dot = strchr(dot+1, '.')){
+        int32_t rule = ignore_chain(ignore, ignore_slot(ignore, Rule_Extension, dot, name+name_len-dot), is_dir);
+        if (rule > best) best = rule;
+    }
+
+    char path[FILENAME_MAX];
+    const char *rel = name;
+    size_t rel_len = name_len;
+    if (ignore->has_anchored){
+        const char *rel_dir = dirname;
+        if (strcmp(ignore->base, ".") == 0){
+            if (strcmp(dirname, ".") == 0) rel_dir = "";
+        } else {
+            rel_dir += ignore->base_len;
+            while (*rel_dir == '/') rel_dir++;
+        }
+        const char *prefix = ignore->prefix != NULL ? ignore->prefix : "";
+        if (*rel_dir != '\0' || *prefix != '\0'){
+            int n = snprintf(path, sizeof(path), "%s%s%s%s%s", prefix, *prefix ? "/" : "", rel_dir, *rel_dir ? "/" : "", name);
+            if (n > 0 && (size_t) n < sizeof(path)){
+                rel = path;
+                rel_len = n;
+            }
+        }
+    }
+    for (size_t i=0; i<ignore->glob_count && ignore->globs[i] > best; ++i){
+        const ignore_rule_t *rule = &ignore->rules[ignore->globs[i]];
+        if (rule->dir_only && !is_dir) continue;
+        const char *text = rule->anchored ? rel : name;
+        size_t text_len = rule->anchored ? rel_len : name_len;
+        if (glob_match(rule->pattern, rule->pattern+rule->len, text, text+text_len)){
+            best = ignore->globs[i];
+            break;
+        }
+    }
+    if (best < 0) return -1;
+    return ignore->rules[best].negated ? 0 : 1;
+}
+
+bool is_ignored(const ignore_t *ignore, const char *dirname, const char *name, bool is_dir)
+{
+    for (; ignore != NULL; ignore = ignore->parent){
+        int decision = ignore_decide(ignore, dirname, name, is_dir);
+        if (decision >= 0) return decision == 1;
+    }
+    return false;
+}
+
+ignore_t* ignore_retain(ignore_t *ignore)
+{
+    if (ignore != NULL) atomic_fetch_add(&ignore->refs, 1);
+    return ignore;
+}
+
+void ignore_release(ignore_t *ignore)
+{
+    while (ignore != NULL && atomic_fetch_sub(&ignore->refs, 1) == 1){
+        ignore_t *parent = ignore->parent;
+        free(ignore->base);
+        free(ignore->prefix);
+        free(ignore->text);
+        free(ignore->rules);
+        free(ignore->slots);
+        free(ignore->globs);
+        free(ignore);
+        ignore = parent;
+    }
+}
+
+// compile rules from a text of gitignore lines, inheriting from `parent`; returns `parent` if there are no rules
+ignore_t* ignore_compile(ignore_t *parent, const char *base, char *text)
+{
+    size_t capacity = 1;
+    for (const char *c=text; *c; ++c) capacity += *c == '\n';
+    ignore_rule_t *rules = malloc(capacity*sizeof(*rules));
+    assert(rules != NULL && "Out of memory!");
+    size_t count = 0;
+    for (char *line = text; line != NULL && count < capacity;){
+        char *end = strchr(line, '\n');
+        if (end != NULL) *end = '\0';
+        if (ignore_parse_rule(line, &rules[count])) count++;
+        line = end != NULL ? end+1 : NULL;
+    }
+    if (count == 0){
+        free(rules);
+        free(text);
+        return ignore_retain(parent);
+    }
+    ignore_t *ignore = calloc(1, sizeof(*ignore));
+    assert(ignore != NULL && "Out of memory!");
+    ignore->parent = ignore_retain(parent);
+    atomic_init(&ignore->refs, 1);
+    ignore->base = strdup(base);
+    assert(ignore->base != NULL && "Out of memory!");
+    ignore->base_len = strlen(base);
+    ignore->text = text;
+    ignore->rules = rules;
+    ignore->count = count;
+    ignore_index(ignore);
+    return ignore;
+}
+
+// append the content of an ignore file relative to `dir_fd`, if it exists
+void ignore_read(clags_sb_t *sb, int dir_fd, const char *dirname, const char *name)
+{
+    int fd = openat(dir_fd, name, O_RDONLY);
+    if (fd == -1){
+        if (errno != ENOENT && errno != ENOTDIR) fprintf(stderr, "[ERROR] Could not open '%s/%s': %s!\n", dirname, name, strerror(errno));
+        return;
+    }
+    char chunk[READ_CHUNK_SIZE];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0) sb_append(sb, chunk, n);
+    sb_append(sb, "\n", 1);
+    close(fd);
+}
+
+// load the ignore files of a directory; lower precedence comes first: .git/info/exclude, .gitignore, .ignore
+ignore_t* ignore_load(ignore_t *parent, int dir_fd, const char *dirname)
+{
+    clags_sb_t sb = {0};
+    ignore_read(&sb, dir_fd, dirname, ".git/info/exclude");
+    ignore_read(&sb, dir_fd, dirname, ".gitignore");
+    ignore_read(&sb, dir_fd, dirname, ".ignore");
+    if (sb.count == 0) return ignore_retain(parent);
+    clags_sb_append_null(&sb);
+    return ignore_compile(parent, dirname, sb.items);
+}
+
+// load the ignore files of the directories above a root, up to the enclosing git repository
+ignore_t* ignore_load_ancestors(ignore_t *parent, const char *root)
+{
+    char real[FILENAME_MAX];
+    if (realpath(root, real) == NULL) return ignore_retain(parent);
+    // collect the ancestors from the nearest one up
+    char *ancestors[FILENAME_MAX/2];
+    size_t count = 0;
+    bool in_repo = false;
+    for (char *slash = strrchr(real, '/'); slash != NULL && count < sizeof(ancestors)/sizeof(*ancestors);){
+        size_t len = slash == real ? 1 : (size_t)(slash-real);
+        ancestors[count] = strndup(real, len);
+        assert(ancestors[count] != NULL && "Out of memory!");
+        char git[FILENAME_MAX];
+        snprintf(git, sizeof(git), "%s/.git", ancestors[count++]);
+        struct stat attr;
+        if (stat(git, &attr) == 0){
+            in_repo = true;
+            break;
+        }
+        if (slash == real) break;
+        *slash = '\0';
+        slash = strrchr(real, '/');
+    }
+    // outside of a git repository only the root's own ignore files apply
+    ignore_t *ignore = ignore_retain(parent);
+    for (size_t i=count; i-- > 0;){
+        if (in_repo){
+            int fd = open(ancestors[i], O_RDONLY | O_DIRECTORY);
+            if (fd != -1){
+                ignore_t *loaded = ignore_load(ignore, fd, ancestors[i]);
+                close(fd);
+                if (loaded != ignore){
+                    // match paths below the root as if they were relative to the ancestor
+                    free(loaded->base);
+                    loaded->base = strdup(root);
+                    loaded->base_len = strlen(root);
+                    if (realpath(root, real) != NULL){
+                        size_t len = strlen(ancestors[i]);
+                        loaded->prefix = strdup(real + len + (len > 1));
+                    }
+                    assert(loaded->base != NULL && "Out of memory!");
+                }
+                ignore_release(ignore);
+                ignore = loaded;
+            }
+        }
+        free(ancestors[i]);
+    }
+    return ignore;
+}
+
+// compile the `-i` names of a root path into rules
+ignore_t* ignore_from_list(clags_list_t names, const char *base)
+{
+    clags_sb_t sb = {0};
+    for (size_t i=0; i<names.count; ++i){
+        const char *name = clags_list_element(names, char*, i);
+        sb_append(&sb, name, strlen(name));
+        sb_append(&sb, "\n", 1);
+    }
+    if (sb.count == 0) return NULL;
+    clags_sb_append_null(&sb);
+    return ignore_compile(NULL, base, sb.items);
+}
+
+// find the git work tree that contains `root`; `top` receives its real path and `prefix` points into `real`,
+// the real path of `root`, at the part below the top, which is empty at the top itself
+bool git_find_top(const char *root, char *real, char *top, size_t top_size, const char **prefix)
+{
+    if (realpath(root, real) == NULL) return false;
+    snprintf(top, top_size, "%s", real);
+    while (true){
+        char git[FILENAME_MAX];
+        snprintf(git, sizeof(git), "%s/.git", strcmp(top, "/") == 0 ? "" : top);
+        struct stat attr;
+        if (stat(git, &attr) == 0) break;
+        char *slash = strrchr(top, '/');
+        if (slash == NULL || strcmp(top, "/") == 0) return false;
+        if (slash == top) slash[1] = '\0';
+        else *slash = '\0';
+    }
+    size_t len = strlen(top);
+    *prefix = real + len + (real[len] == '/');
+    return true;
+}
+
+// the git directory of a work tree; `.git` is a file pointing to it in linked work trees and submodules
+bool git_dir(const char *top, char *buffer, size_t size)
+{
+    snprintf(buffer, size, "%s/.git", top);
+    struct stat attr;
+    if (stat(buffer, &attr) == -1) return false;
+    if (S_ISDIR(attr.st_mode)) return true;
+    clags_sb_t sb = {0};
+    ignore_read(&sb, AT_FDCWD, top, buffer);
+    clags_sb_append_null(&sb);
+    bool found = sb.count > 8 && strncmp(sb.items, "gitdir: ", 8) == 0;
+    if (found){
+        char *dir = sb.items+8;
+        dir[strcspn(dir, "\r\n")] = '\0';
+        if (*dir == '/') snprintf(buffer, size, "%s", dir);
+        else snprintf(buffer, size, "%s/%s", top, dir);
+    }
+    clags_sb_free(&sb);
+    return found;
+}
+
+uint32_t read_be32(const unsigned char *data)
+{
+    return (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 | (uint32_t) data[2] << 8 | data[3];
+}
+
+// the size of object ids in a repository, SHA-1 unless the config says otherwise
+size_t git_hash_size(const char *dir)
+{
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s/config", dir);
+    clags_sb_t sb = {0};
+    ignore_read(&sb, AT_FDCWD, dir, path);
+    clags_sb_append_null(&sb);
+    size_t size = 20;
+    for (char *line = sb.items; line != NULL && *line; line = strchr(line, '\n') ? strchr(line, '\n')+1 : NULL){
+        const char *key = skip_spaces(line, line+strlen(line));
+        if (strncasecmp(key, "objectformat", 12) == 0 && strstr(key, "sha256") != NULL) size = 32;
+    }
+    clags_sb_free(&sb);
+    return size;
+}
+
+// append the paths of the regular files in the index of the git directory `dir` to `paths`, each NUL terminated;
+// supports index versions 2 to 4 and skips conflict stages, files outside of a sparse checkout, submodules and symlinks
+bool git_read_index(const char *dir, clags_sb_t *paths)
+{
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s/index", dir);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat attr;
+    if (fd == -1 || fstat(fd, &attr) == -1){
+        fprintf(stderr, "[ERROR] Could not read git index '%s': %s!\n", path, strerror(errno));
+        if (fd != -1) close(fd);
+        return false;
+    }
+    void *blob = attr.st_size > 0 ? mmap(NULL, attr.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (blob == MAP_FAILED){
+        fprintf(stderr, "[ERROR] Could not read git index '%s'!\n", path);
+        return false;
+    }
+    reader_t reader = {.data=blob, .size=attr.st_size};
+    const unsigned char *header = reader_take(&reader, 12);
+    uint32_t version = header != NULL ? read_be32(header+4) : 0;
+    if (header == NULL || memcmp(header, "DIRC", 4) != 0 || version < 2 || version > 4){
+        fprintf(stderr, "[ERROR] Unsupported git index '%s'!\n", path);
+        munmap(blob, attr.st_size);
+        return false;
+    }
+    uint32_t count = read_be32(header+8);
+    size_t fixed = 40 + git_hash_size(dir) + 2;
+    clags_sb_t name = {0};  // version 4 compresses each name against the previous one
+    size_t last = SIZE_MAX; // the offset of the last name appended to `paths`
+    for (uint32_t i=0; i<count && !reader.failed; ++i){
+        size_t start = reader.offset;
+        const unsigned char *entry = reader_take(&reader, fixed);
+        if (entry == NULL) break;
+        uint32_t mode = read_be32(entry+24);
+        uint16_t flags = entry[fixed-2] << 8 | entry[fixed-1];
+        bool skip_worktree = false;
+        if (flags & 0x4000){
+            const unsigned char *extended = reader_take(&reader, 2);
+            if (extended == NULL) break;
+            skip_worktree = extended[0] & 0x40;
+        }
+        if (version == 4){
+            size_t strip = 0;
+            const unsigned char *c;
+            while ((c = reader_take(&reader, 1)) != NULL){
+                strip = (strip << 7) | (*c & 0x7f);
+                if (!(*c & 0x80)) break;
+                strip++;
+            }
+            if (c == NULL || strip > name.count) break;
+            name.count -= strip;
+        } else {
+            name.count = 0;
+        }
+        const char *suffix = reader.data+reader.offset;
+        const char *end = memchr(suffix, '\0', reader.size-reader.offset);
+        if (end == NULL) break;
+        sb_append(&name, suffix, end-suffix);
+        reader.offset = end-reader.data+1;
+        // versions 2 and 3 pad each entry with 1 to 8 NUL bytes to a multiple of 8
+        if (version < 4){
+            size_t padded = start + ((end-reader.data - start + 8) & ~(size_t)7);
+            if (padded > reader.size) break;
+            reader.offset = padded;
+        }
+        bool regular = (mode & 0170000) == 0100000;
+        if (!regular || skip_worktree) continue;
+        // the entries of a conflict share a name and follow each other
+        if (last != SIZE_MAX && strlen(paths->items+last) == name.count && memcmp(paths->items+last, name.items, name.count) == 0) continue;
+        last = paths->count;
+        sb_append(paths, name.items, name.count);
+        sb_append_char(paths, '\0', 1);
+    }
+    bool ok = !reader.failed;
+    if (!ok) fprintf(stderr, "[ERROR] Malformed git index '%s'!\n", path);
+    clags_sb_free(&name);
+    munmap(blob, attr.st_size);
+    return ok;
+}
+
+// append the files changed between `rev` and the work tree below `root` to `paths`, relative to it and each NUL terminated
+bool git_read_changed(const char *root, const char *rev, clags_sb_t *paths)
+{
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1){
+        fprintf(stderr, "[ERROR] Could not run git: %s!\n", strerror(errno));
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == -1){
+        fprintf(stderr, "[ERROR] Could not run git: %s!\n", strerror(errno));
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return false;
+    }
+    if (pid == 0){
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        execlp("git", "git", "-C", root, "diff", "--name-only", "-z", "--no-renames", "--diff-filter=d", "--relative", rev, "--", (char*) NULL);
+        fprintf(stderr, "[ERROR] Could not run git: %s!\n", strerror(errno));
+        _exit(127);
+    }
+    close(pipe_fds[1]);
+    char chunk[READ_CHUNK_SIZE];
+    ssize_t n;
+    while ((n = read(pipe_fds[0], chunk, sizeof(chunk))) != 0){
+        if (n < 0){
+            if (errno == EINTR) continue;
+            break;
+        }
+        sb_append(paths, chunk, n);
+    }
+    close(pipe_fds[0]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        fprintf(stderr, "[ERROR] Could not list the files changed since '%s' in '%s'!\n", rev, root);
+        return false;
+    }
+    return true;
+}
+
+// whether the walk of `root` would skip a file at `rel` below it: it lies in a hidden directory, or a rule excludes it
+bool git_path_skipped(const ignore_t *ignore, const char *root, const char *rel)
+{
+    char dirname[FILENAME_MAX], name[FILENAME_MAX];
+    snprintf(dirname, sizeof(dirname), "%s", root);
+    while (true){
+        size_t len = strcspn(rel, "/");
+        bool is_dir = rel[len] == '/';
+        if (len >= sizeof(name)) return true;
+        memcpy(name, rel, len);
+        name[len] = '\0';
+        if (is_dir && *name == '.') return true;
+        if (is_ignored(ignore, dirname, name, is_dir)) return true;
+        if (!is_dir) return false;
+        char joined[FILENAME_MAX];
+        snprintf(dirname, sizeof(dirname), "%s", join_path(dirname, name, joined, sizeof(joined)));
+        rel += len+1;
+    }
+}
+
+void deque_push(deque_t *deque, task_t task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count >= deque->capacity){
+        size_t new_capacity = deque->capacity == 0 ? DEQUE_INIT_CAPACITY : deque->capacity*2;
+        task_t *items = malloc(new_capacity*sizeof(*items));
+        assert(items != NULL && "Out of memory!");
+        for (size_t i=0; i<deque->count; ++i){
+            items[i] = deque->items[(deque->top+i)%deque->capacity];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->capacity = new_capacity;
+        deque->top = 0;
+    }
+    deque->items[(deque->top+deque->count)%deque->capacity] = task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+bool deque_pop(deque_t *deque, task_t *task)
+{
+    bool result = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0){
+        deque->count--;
+        *task = deque->items[(deque->top+deque->count)%deque->capacity];
+        result = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return result;
+}
+
+bool deque_steal(deque_t *deque, task_t *task)
+{
+    bool result = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0){
+        *task = deque->items[deque->top];
+        deque->top = (deque->top+1)%deque->capacity;
+        deque->count--;
+        result = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return result;
+}
+
+void pool_submit(worker_t *worker, task_t task)
+{
+    pool_t *pool = worker->pool;
+    atomic_fetch_add(&pool->pending, 1);
+    deque_push(&worker->deque, task);
+    atomic_fetch_add(&pool->queued, 1);
+    if (atomic_load(&pool->sleeping) > 0){
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+void pool_push(worker_t *worker, task_kind_t kind, const char *path, ignore_t *ignore, slot_t *slot)
+{
+    char *owned = arena_strdup(&worker->arena, path);
+    pool_submit(worker, (task_t){.kind=kind, .path=owned, .ignore=ignore_retain(ignore), .slot=slot});
+}
+
+bool pool_take(worker_t *worker, task_t *task)
+{
+    pool_t *pool = worker->pool;
+    if (atomic_load(&pool->queued) == 0) return false;
+    bool found = deque_pop(&worker->deque, task);
+    for (size_t i=1; !found && i<pool->count; ++i){
+        found = deque_steal(&pool->workers[(worker->id+i)%pool->count].deque, task);
+    }
+    if (found) atomic_fetch_sub(&pool->queued, 1);
+    return found;
+}
+
+#ifdef TOD_URING
+bool uring_init(uring_t *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return false;
+    // the open and read operations came with the same kernel as this feature
+    if (!(params.features & IORING_FEAT_CUR_PERSONALITY)) goto fail;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto fail;
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) goto fail_sq;
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail_cq;
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    return true;
+
+fail_cq:
+    munmap(ring->cq_ring, ring->cq_ring_size);
+fail_sq:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+fail:
+    close(ring->fd);
+    return false;
+}
+
+void uring_free(uring_t *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// queue a request; `index` identifies its result and must be below PREFETCH_BATCH_SIZE
+struct io_uring_sqe* uring_queue(uring_t *ring, unsigned pending, unsigned index)
+{
+    unsigned tail = *ring->sq_tail + pending;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = index;
+    ring->sq_array[slot] = slot;
+    return sqe;
+}
+
+// submit `count` queued requests and wait for all of them; `results` receives their results by index, and
+// `arrived` tells which ones did, should the ring fail before all of them are done
+bool uring_run(uring_t *ring, unsigned count, int *results, bool *arrived)
+{
+    memset(arrived, 0, count*sizeof(*arrived));
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+    unsigned submitted = 0, completed = 0;
+    while (completed < count){
+        int n = syscall(__NR_io_uring_enter, ring->fd, count-submitted, count-completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0 && errno != EINTR) return false;
+        if (n > 0) submitted += n;
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head, ++completed){
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            results[cqe->user_data] = cqe->res;
+            arrived[cqe->user_data] = true;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+// open the queued files with a whole batch in flight; false if the ring failed and the files must be opened in order
+bool uring_open(worker_t *worker, int dir_fd)
+{
+    int results[PREFETCH_BATCH_SIZE];
+    size_t count = worker->prefetch_count;
+    for (size_t i=0; i<count; ++i){
+        struct io_uring_sqe *sqe = uring_queue(&worker->ring, i, i);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = dir_fd;
+        sqe->addr = (uintptr_t) (worker->prefetch_names.items + worker->prefetch[i].name_offset);
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    }
+    bool arrived[PREFETCH_BATCH_SIZE];
+    if (!uring_run(&worker->ring, count, results, arrived)){
+        // the files are opened again in order, those the ring opened already are closed
+        for (size_t i=0; i<count; ++i){
+            if (arrived[i] && results[i] >= 0) close(results[i]);
+        }
+        return false;
+    }
+    for (size_t i=0; i<count; ++i){
+        worker->prefetch[i].fd = results[i] >= 0 ? results[i] : -1;
+        worker->prefetch[i].error = results[i] >= 0 ? 0 : -results[i];
+    }
+    return true;
+}
+
+// read the start of the files in `misses` with all reads in flight; a failed read is simply done again by `search_file`
+bool uring_read(worker_t *worker, const size_t *misses, size_t miss_count)
+{
+    int results[PREFETCH_BATCH_SIZE];
+    for (size_t i=0; i<miss_count; ++i){
+        prefetch_t *file = &worker->prefetch[misses[i]];
+        struct io_uring_sqe *sqe = uring_queue(&worker->ring, i, i);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = file->fd;
+        sqe->addr = (uintptr_t) (worker->prefetch_buffer + misses[i]*PREFETCH_SIZE);
+        sqe->len = PREFETCH_SIZE;
+        sqe->off = 0;
+    }
+    bool arrived[PREFETCH_BATCH_SIZE];
+    if (!uring_run(&worker->ring, miss_count, results, arrived)) return false;
+    for (size_t i=0; i<miss_count; ++i){
+        prefetch_t *file = &worker->prefetch[misses[i]];
+        if (results[i] < 0) continue;
+        file->data = worker->prefetch_buffer + misses[i]*PREFETCH_SIZE;
+        file->count = results[i];
+    }
+    return true;
+}
+#endif // TOD_URING
+
+// queue a file of the directory being searched for `prefetch_run`
+void prefetch_add(worker_t *worker, const char *name, const struct stat *attr)
+{
+    prefetch_t *file = &worker->prefetch[worker->prefetch_count++];
+    memset(file, 0, sizeof(*file));
+    file->name_offset = worker->prefetch_names.count;
+    sb_append(&worker->prefetch_names, name, strlen(name) + 1);
+    file->have_attr = attr != NULL;
+    if (attr != NULL) file->attr = *attr;
+    file->fd = -1;
+}
+
+// open all queued files and read their start, then search them in the order they were queued.
+// what is in the page cache is read right away; the rest is read with the whole batch in flight,
+// by io_uring or by the kernel's readahead, instead of waiting on one file at a time
+void prefetch_run(worker_t *worker, int dir_fd, const char *dirname)
+{
+    pool_t *pool = worker->pool;
+    size_t count = worker->prefetch_count;
+    if (count == 0) return;
+    phase_t previous = stats_phase(worker, Phase_File);
+    bool opened = false;
+#ifdef TOD_URING
+    // opening through the ring only pays off when the disk is actually hit
+    if (worker->has_ring && worker->cold){
+        opened = uring_open(worker, dir_fd);
+        // a ring that failed once is torn down, which cancels what is still in flight
+        if (!opened){
+            uring_free(&worker->ring);
+            worker->has_ring = false;
+        }
+    }
+#endif // TOD_URING
+    for (size_t i=0; i<count && !opened; ++i){
+        prefetch_t *file = &worker->prefetch[i];
+        file->fd = openat(dir_fd, worker->prefetch_names.items + file->name_offset, O_RDONLY | O_CLOEXEC);
+        file->error = errno;
+    }
+#ifdef RWF_NOWAIT
+    // cached files are usually not read at all
+    if (pool->cache == NULL){
+        if (worker->prefetch_buffer == NULL){
+            worker->prefetch_buffer = malloc(PREFETCH_BATCH_SIZE*PREFETCH_SIZE);
+            assert(worker->prefetch_buffer != NULL && "Out of memory!");
+            // a nonblocking read into a page that was never touched fails just like a page cache miss
+            memset(worker->prefetch_buffer, 0, PREFETCH_BATCH_SIZE*PREFETCH_SIZE);
+        }
+        size_t misses[PREFETCH_BATCH_SIZE];
+        size_t miss_count = 0;
+        for (size_t i=0; i<count; ++i){
+            prefetch_t *file = &worker->prefetch[i];
+            if (file->fd == -1) continue;
+            struct iovec iov = {worker->prefetch_buffer + i*PREFETCH_SIZE, PREFETCH_SIZE};
+            ssize_t n = preadv2(file->fd, &iov, 1, 0, RWF_NOWAIT);
+            if (n >= 0){
+                file->data = iov.iov_base;
+                file->count = n;
+            } else if (errno == EAGAIN){
+                misses[miss_count++] = i;
+            }
+        }
+        bool read = false;
+#ifdef TOD_URING
+        if (miss_count > 0 && worker->has_ring){
+            read = uring_read(worker, misses, miss_count);
+            if (!read){
+                uring_free(&worker->ring);
+                worker->has_ring = false;
+                // reads that were in flight may still land in the buffer, the next batch gets a new one
+                worker->stale_buffer = worker->prefetch_buffer;
+                worker->prefetch_buffer = NULL;
+            }
+        }
+        worker->cold = miss_count > 0;
+#endif // TOD_URING
+        for (size_t i=0; i<miss_count && !read; ++i){
+            (void) posix_fadvise(worker->prefetch[misses[i]].fd, 0, 0, POSIX_FADV_WILLNEED);
+        }
+    }
+#endif // RWF_NOWAIT
+    for (size_t i=0; i<count; ++i){
+        const prefetch_t *file = &worker->prefetch[i];
+        const char *name = worker->prefetch_names.items + file->name_offset;
+        if (pool_stopped(pool)){
+            if (file->fd != -1) close(file->fd);
+            continue;
+        }
+        (void) search_file(worker, dir_fd, dirname, name, file->have_attr ? &file->attr : NULL, file);
+    }
+    worker->prefetch_count = 0;
+    worker->prefetch_names.count = 0;
+    stats_phase(worker, previous);
+}
+
+typedef enum{
+    Entry_Skip,
+    Entry_Dir,
+    Entry_File,
+} entry_kind_t;
+
+// whether a file is searched with --shard: its path as it is printed, the same on every node given the same
+// input paths, is hashed onto one of the shards
+bool in_shard(const pool_t *pool, const char *dirname, const char *name)
+{
+    if (pool->shard_count <= 1) return true;
+    uint64_t hash = HASH_SEED;
+    if (dirname != NULL && strcmp(dirname, ".") != 0){
+        size_t len = strlen(dirname);
+        hash = hash_bytes(hash, dirname, len);
+        if (len > 0 && dirname[len-1] != '/') hash = hash_bytes(hash, "/", 1);
+    }
+    hash = hash_bytes(hash, name, strlen(name));
+    // the high bits are folded in, the low bits of FNV alone spread poorly over small shard counts
+    hash ^= hash >> 32;
+    return hash%pool->shard_count == pool->shard;
+}
+
+// stat an entry of the directory `dir_fd` the way --follow says, reporting why it cannot be
+bool stat_entry(worker_t *worker, int dir_fd, const char *dirname, const char *name, struct stat *attr)
+{
+    worker->stats.stats += 1;
+    if (fstatat(dir_fd, name, attr, worker->pool->follow ? 0 : AT_SYMLINK_NOFOLLOW) == -1){
+        char path[FILENAME_MAX];
+        fprintf(stderr, "[ERROR] Could not access '%s': %s!\n", join_path(dirname, name, path, sizeof(path)), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// tell what to do with a directory entry. only entries of unknown type and symbolic links are stat'ed,
+// relative to the directory, and with --one-file-system directories too, to compare them to `device`, the one
+// of the directory the entry is in; `have_attr` tells whether `attr` was filled
+entry_kind_t classify_entry(worker_t *worker, int dir_fd, const char *dirname, dev_t device, const ignore_t *ignore, const struct dirent *entry, struct stat *attr, bool *have_attr)
+{
+    pool_t *pool = worker->pool;
+    const char *name = entry->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return Entry_Skip;
+    worker->stats.entries += 1;
+    if (entry->d_type == DT_LNK && !pool->follow) return Entry_Skip;
+    *have_attr = entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK;
+    bool is_dir = entry->d_type == DT_DIR;
+    bool is_reg = entry->d_type == DT_REG;
+    if (*have_attr){
+        if (!stat_entry(worker, dir_fd, dirname, name, attr)) return Entry_Skip;
+        is_dir = S_ISDIR(attr->st_mode);
+        is_reg = S_ISREG(attr->st_mode);
+    }
+    if (is_ignored(ignore, dirname, name, is_dir)) return Entry_Skip;
+    if (is_dir && *name != '.'){
+        if (!pool->one_file_system) return Entry_Dir;
+        if (!*have_attr && !stat_entry(worker, dir_fd, dirname, name, attr)) return Entry_Skip;
+        *have_attr = true;
+        // a mount point, or a link to a directory on another file system
+        return attr->st_dev == device ? Entry_Dir : Entry_Skip;
+    }
+    return is_reg && in_shard(worker->pool, dirname, name) ? Entry_File : Entry_Skip;
+}
+
+// an entry of a directory searched with --sort; `name` is set once all entries are read
+typedef struct{
+    size_t name_offset;
+    const char *name;
+    bool is_dir;
+    bool have_attr;
+    struct stat attr;
+} sorted_entry_t;
+
+typedef struct{
+    sorted_entry_t *items;
+    size_t count;
+    size_t capacity;
+} sorted_entries_t;
+
+int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const sorted_entry_t*) a)->name, ((const sorted_entry_t*) b)->name);
+}
+
+int search_dir(worker_t *worker, const char *dirname, ignore_t *ignore, slot_t *slot);
+
+// search the entries of a directory in name order. they are all read and sorted first, then every subdirectory
+// and every batch of files gets a slot of its own, so the output can be put in order whichever worker searches what
+void search_entries_sorted(worker_t *worker, DIR *dir, const char *dirname, dev_t device, ignore_t *ignore, slot_t *slot)
+{
+    pool_t *pool = worker->pool;
+    int dir_fd = dirfd(dir);
+    sorted_entries_t entries = {0};
+    clags_sb_t names = {0};
+    struct dirent *entry;
+    while ((entry = readdir(dir)) && !pool_stopped(pool)){
+        sorted_entry_t item = {.name_offset=names.count};
+        entry_kind_t kind = classify_entry(worker, dir_fd, dirname, device, ignore, entry, &item.attr, &item.have_attr);
+        if (kind == Entry_Skip) continue;
+        item.is_dir = kind == Entry_Dir;
+        sb_append(&names, entry->d_name, strlen(entry->d_name) + 1);
+        if (entries.count >= entries.capacity){
+            entries.capacity = entries.capacity == 0 ? MATCHES_INIT_CAPACITY : entries.capacity*2;
+            entries.items = realloc(entries.items, entries.capacity*sizeof(*entries.items));
+            assert(entries.items != NULL && "Out of memory!");
+        }
+        entries.items[entries.count++] = item;
+    }
+    for (size_t i=0; i<entries.count; ++i) entries.items[i].name = names.items + entries.items[i].name_offset;
+    qsort(entries.items, entries.count, sizeof(*entries.items), compare_entries);
+
+    // consecutive files are searched as prefetch batches, each batch is one slot
+    size_t child_count = 0;
+    for (size_t i=0, run=0; i<entries.count; ++i){
+        if (entries.items[i].is_dir){
+            child_count += 1;
+            run = 0;
+        } else {
+            child_count += run == 0;
+            run = (run+1)%PREFETCH_BATCH_SIZE;
+        }
+    }
+    slot_t *children = NULL;
+    if (child_count > 0){
+        children = calloc(child_count, sizeof(*children));
+        assert(children != NULL && "Out of memory!");
+        for (size_t i=0; i<child_count; ++i){
+            children[i].parent = slot;
+            children[i].next = i+1 < child_count ? &children[i+1] : NULL;
+        }
+    }
+    slot_expand(pool, slot, children);
+
+    // once the last child is finished the cursor may free `children`, it is not touched after that
+    char item_path[FILENAME_MAX];
+    slot_t *batch = NULL;
+    size_t next_child = 0;
+    for (size_t i=0; i<entries.count; ++i){
+        const sorted_entry_t *item = &entries.items[i];
+        if (batch != NULL && (item->is_dir || worker->prefetch_count == PREFETCH_BATCH_SIZE)){
+            prefetch_run(worker, dir_fd, dirname);
+            slot_finish(worker, batch);
+            batch = NULL;
+        }
+        if (item->is_dir){
+            slot_t *child = &children[next_child++];
+            join_path(dirname, item->name, item_path, sizeof(item_path));
+            if (pool_stopped(pool)) slot_finish(worker, child);
+            else if (pool->count > 1) pool_push(worker, Task_Dir, item_path, ignore, child);
+            else (void) search_dir(worker, item_path, ignore, child);
+        } else {
+            if (batch == NULL) batch = &children[next_child++];
+            prefetch_add(worker, item->name, item->have_attr ? &item->attr : NULL);
+        }
+    }
+    if (batch != NULL){
+        prefetch_run(worker, dir_fd, dirname);
+        slot_finish(worker, batch);
+    }
+    free(entries.items);
+    clags_sb_free(&names);
+}
+
+// search a directory; with --sort its output goes to `slot`, which is finished by the call
+int search_dir(worker_t *worker, const char *dirname, ignore_t *ignore, slot_t *slot)
+{
+    pool_t *pool = worker->pool;
+    int fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL){
+        fprintf(stderr, "[ERROR] Could not open directory: '%s': %s!\n", dirname, strerror(errno));
+        if (fd != -1) close(fd);
+        if (slot != NULL) slot_finish(worker, slot);
+        return 1;
+    }
+    int dir_fd = dirfd(dir);
+    struct stat dir_attr;
+    worker->stats.stats += 1;
+    if (fstat(dir_fd, &dir_attr) == -1){
+        fprintf(stderr, "[ERROR] Could not access '%s': %s!\n", dirname, strerror(errno));
+        closedir(dir);
+        if (slot != NULL) slot_finish(worker, slot);
+        return 1;
+    }
+    // a link loop, or a tree reached through another link or bind mount
+    if (!visit(pool, &dir_attr)){
+        worker->stats.duplicates += 1;
+        closedir(dir);
+        if (slot != NULL) slot_finish(worker, slot);
+        return 0;
+    }
+    worker->stats.dirs += 1;
+    if (pool->gitignore) ignore = ignore_load(ignore, dir_fd, dirname);
+    else ignore = ignore_retain(ignore);
+    if (slot != NULL){
+        search_entries_sorted(worker, dir, dirname, dir_attr.st_dev, ignore, slot);
+        closedir(dir);
+        ignore_release(ignore);
+        return 0;
+    }
+
+    struct dirent *entry;
+    char item_path[FILENAME_MAX] = {0};
+    while ((entry = readdir(dir)) && !pool_stopped(pool)){
+        struct stat attr;
+        bool have_attr;
+        entry_kind_t kind = classify_entry(worker, dir_fd, dirname, dir_attr.st_dev, ignore, entry, &attr, &have_attr);
+        if (kind == Entry_Dir){
+            join_path(dirname, entry->d_name, item_path, sizeof(item_path));
+            // with a single worker, recursing keeps the output in traversal order
+            if (pool->count > 1){
+                pool_push(worker, Task_Dir, item_path, ignore, NULL);
+            } else {
+                prefetch_run(worker, dir_fd, dirname);
+                (void) search_dir(worker, item_path, ignore, NULL);
+            }
+        } else if (kind == Entry_File){
+            prefetch_add(worker, entry->d_name, have_attr ? &attr : NULL);
+            if (worker->prefetch_count == PREFETCH_BATCH_SIZE) prefetch_run(worker, dir_fd, dirname);
+        }
+    }
+    prefetch_run(worker, dir_fd, dirname);
+    closedir(dir);
+    ignore_release(ignore);
+    return 0;
+}
+
+void run_task(worker_t *worker, task_t task)
+{
+    // once the scan is stopped, the remaining tasks are only taken to be dropped
+    if (!pool_stopped(worker->pool)){
+        switch (task.kind){
+            case Task_Dir:
+                stats_phase(worker, Phase_Dir);
+                (void) search_dir(worker, task.path, task.ignore, task.slot);
+                break;
+            case Task_File:
+                stats_phase(worker, Phase_File);
+                (void) search_file(worker, AT_FDCWD, NULL, task.path, NULL, NULL);
+                if (task.slot != NULL) slot_finish(worker, task.slot);
+                break;
+            case Task_Split:
+                split_help(worker, task.split);
+                split_release(task.split);
+                break;
+        }
+        stats_phase(worker, Phase_Idle);
+    } else if (task.slot != NULL){
+        // a dropped task leaves an empty slot
+        slot_finish(worker, task.slot);
+    } else if (task.split != NULL){
+        split_release(task.split);
+    }
+    ignore_release(task.ignore);
+}
+
+void* worker_main(void *arg)
+{
+    worker_t *worker = arg;
+    pool_t *pool = worker->pool;
+    while (true){
+        task_t task;
+        if (pool_take(worker, &task)){
+            run_task(worker, task);
+            if (atomic_fetch_sub(&pool->pending, 1) == 1){
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->idle_cond);
+                pthread_mutex_unlock(&pool->idle_lock);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&pool->idle_lock);
+        atomic_fetch_add(&pool->sleeping, 1);
+        while (atomic_load(&pool->queued) == 0 && atomic_load(&pool->pending) > 0){
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        atomic_fetch_sub(&pool->sleeping, 1);
+        bool done = atomic_load(&pool->pending) == 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+        if (done) break;
+    }
+    return NULL;
+}
+
+void tally_add(tally_t *tally, const char *key, size_t key_len, size_t count)
+{
+    size_t hash = hash_bytes(HASH_SEED, key, key_len);
+    size_t slot = hash & (tally->slot_count-1);
+    while (tally->slot_count > 0 && tally->slots[slot] != 0){
+        tally_item_t *item = &tally->items[tally->slots[slot]-1];
+        if (item->key_len == key_len && memcmp(item->key, key, key_len) == 0){
+            item->count += count;
+            return;
+        }
+        slot = (slot+1) & (tally->slot_count-1);
+    }
+    if (tally->count == tally->capacity){
+        tally->capacity = tally->capacity == 0 ? MATCHES_INIT_CAPACITY : tally->capacity*2;
+        tally->items = realloc(tally->items, tally->capacity*sizeof(*tally->items));
+        assert(tally->items != NULL && "Out of memory!");
+    }
+    if ((tally->count+1)*2 > tally->slot_count){
+        free(tally->slots);
+        tally->slot_count = tally->slot_count == 0 ? MATCHES_INIT_CAPACITY : tally->slot_count*2;
+        tally->slots = calloc(tally->slot_count, sizeof(*tally->slots));
+        assert(tally->slots != NULL && "Out of memory!");
+        for (size_t i=0; i<tally->count; ++i){
+            size_t slot = hash_bytes(HASH_SEED, tally->items[i].key, tally->items[i].key_len) & (tally->slot_count-1);
+            while (tally->slots[slot] != 0) slot = (slot+1) & (tally->slot_count-1);
+            tally->slots[slot] = i+1;
+        }
+    }
+    slot = hash & (tally->slot_count-1);
+    while (tally->slots[slot] != 0) slot = (slot+1) & (tally->slot_count-1);
+    tally->slots[slot] = tally->count+1;
+    tally_item_t *item = &tally->items[tally->count++];
+    item->key = strndup(key, key_len);
+    assert(item->key != NULL && "Out of memory!");
+    item->key_len = key_len;
+    item->count = count;
+}
+
+void tally_free(tally_t *tally)
+{
+    for (size_t i=0; i<tally->count; ++i) free(tally->items[i].key);
+    free(tally->items);
+    free(tally->slots);
+    memset(tally, 0, sizeof(*tally));
+}
+
+// count the matches of a file by tag, owner, priority and directory, for --summary
+void summary_add(worker_t *worker, const char *filename)
+{
+    const matcher_t *matcher = worker->pool->matcher;
+    const match_list_t *matches = &worker->matches;
+    tally_t *tallies = worker->tallies;
+    if (matches->count == 0) return;
+    for (size_t i=0; i<matches->count; ++i){
+        const match_t *match = &matches->items[i];
+        const char *tag = matcher->tags[match->pattern];
+        tally_add(&tallies[Tally_Tag], tag, strlen(tag), 1);
+        if (match->owner_len > 0) tally_add(&tallies[Tally_Owner], match->text+match->owner, match->owner_len, 1);
+        else tally_add(&tallies[Tally_Owner], "-", 1, 1);
+        char priority[2] = {'P', match->priority};
+        if (match->priority != '\0') tally_add(&tallies[Tally_Priority], priority, sizeof(priority), 1);
+        else tally_add(&tallies[Tally_Priority], "-", 1, 1);
+    }
+    // the directory keeps no trailing separator, files without one are in "."
+    size_t dirname_len;
+    cwk_path_get_dirname(filename, &dirname_len);
+    while (dirname_len > 1 && filename[dirname_len-1] == '/') dirname_len--;
+    if (dirname_len > 0) tally_add(&tallies[Tally_Dir], filename, dirname_len, matches->count);
+    else tally_add(&tallies[Tally_Dir], ".", 1, matches->count);
+}
+
+int compare_tally_items(const void *a, const void *b)
+{
+    const tally_item_t *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    int order = memcmp(x->key, y->key, x->key_len < y->key_len ? x->key_len : y->key_len);
+    if (order != 0) return order;
+    return x->key_len < y->key_len ? -1 : x->key_len > y->key_len;
+}
+
+// merge the tallies of all workers and print them, the largest counts first
+void summary_print(const pool_t *pool)
+{
+    static const char *const titles[Tally_Count] = {
+        [Tally_Tag]="tag",
+        [Tally_Owner]="owner",
+        [Tally_Priority]="priority",
+        [Tally_Dir]="directory",
+    };
+    size_t total = 0;
+    clags_sb_t out = {0};
+    for (size_t kind=0; kind<Tally_Count; ++kind){
+        tally_t merged = {0};
+        for (size_t i=0; i<pool->count; ++i){
+            const tally_t *tally = &pool->workers[i].tallies[kind];
+            for (size_t j=0; j<tally->count; ++j) tally_add(&merged, tally->items[j].key, tally->items[j].key_len, tally->items[j].count);
+        }
+        qsort(merged.items, merged.count, sizeof(*merged.items), compare_tally_items);
+        if (kind == Tally_Tag){
+            for (size_t j=0; j<merged.count; ++j) total += merged.items[j].count;
+            sb_append_uint(&out, total);
+            sb_append_cstr(&out, " matches\n");
+        }
+        sb_append_cstr(&out, "\nby ");
+        sb_append_cstr(&out, titles[kind]);
+        sb_append(&out, ":\n", 2);
+        for (size_t j=0; j<merged.count; ++j){
+            char count[32];
+            int len = snprintf(count, sizeof(count), "%10zu  ", merged.items[j].count);
+            sb_append(&out, count, len);
+            sb_append(&out, merged.items[j].key, merged.items[j].key_len);
+            sb_append_char(&out, '\n', 1);
+        }
+        // the slots are stale once the items are sorted
+        tally_free(&merged);
+    }
+    (void) write_all(STDOUT_FILENO, out.items, out.count);
+    clags_sb_free(&out);
+}
+
+void pool_init(pool_t *pool, size_t count, const matcher_t *matcher)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->count = count > 0 ? count : 1;
+    pool->matcher = matcher;
+    pool->workers = calloc(pool->count, sizeof(*pool->workers));
+    assert(pool->workers != NULL && "Out of memory!");
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    for (size_t i=0; i<VISITED_SHARDS; ++i) pthread_mutex_init(&pool->visited[i].lock, NULL);
+    for (size_t i=0; i<pool->count; ++i){
+        worker_t *worker = &pool->workers[i];
+        worker->id = i;
+        worker->pool = pool;
+        worker->matches.arena = &worker->file_arena;
+        pthread_mutex_init(&worker->deque.lock, NULL);
+#ifdef TOD_URING
+        worker->has_ring = uring_init(&worker->ring, PREFETCH_BATCH_SIZE);
+#endif // TOD_URING
+    }
+}
+
+void pool_free(pool_t *pool)
+{
+    for (size_t i=0; i<pool->count; ++i){
+        worker_t *worker = &pool->workers[i];
+        pthread_mutex_destroy(&worker->deque.lock);
+        free(worker->deque.items);
+        clags_sb_free(&worker->out);
+        clags_sb_free(&worker->cache_out);
+        clags_sb_free(&worker->index_out);
+        arena_free(&worker->arena);
+        arena_free(&worker->file_arena);
+        free(worker->buffer);
+        free(worker->line_starts);
+        clags_sb_free(&worker->prefetch_names);
+        free(worker->prefetch_buffer);
+        for (size_t kind=0; kind<Tally_Count; ++kind) tally_free(&worker->tallies[kind]);
+#ifdef TOD_URING
+        if (worker->has_ring) uring_free(&worker->ring);
+        free(worker->stale_buffer);
+#endif // TOD_URING
+    }
+    arena_free(&pool->sorter.arena);
+    if (pool->sorter.spill != NULL) fclose(pool->sorter.spill);
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+    visited_clear(pool);
+    for (size_t i=0; i<VISITED_SHARDS; ++i) pthread_mutex_destroy(&pool->visited[i].lock);
+    free(pool->workers);
+}
+
+// queue a root path; roots are spread over the workers so they start stealing from each other right away
+void pool_seed(pool_t *pool, task_kind_t kind, const char *path, ignore_t *ignore)
+{
+    if (kind == Task_File && !in_shard(pool, NULL, path)) return;
+    worker_t *worker = &pool->workers[atomic_load(&pool->pending)%pool->count];
+    slot_t *slot = NULL;
+    if (pool->sort){
+        // the roots are written in the order they were given
+        sorter_t *sorter = &pool->sorter;
+        slot = arena_alloc(&sorter->arena, sizeof(*slot));
+        *slot = (slot_t){.parent=&sorter->root};
+        if (sorter->last_root != NULL) sorter->last_root->next = slot;
+        else sorter->root.children = slot;
+        sorter->last_root = slot;
+    }
+    pool_push(worker, kind, path, ignore, slot);
+}
+
+// queue the files git lists below the directory `root` instead of walking it: those in the index,
+// or with `changed_since` those that differ from that revision
+bool pool_seed_git(pool_t *pool, const char *root, const ignore_t *ignore, const char *changed_since)
+{
+    clags_sb_t paths = {0};
+    char real[FILENAME_MAX], top[FILENAME_MAX], dir[FILENAME_MAX];
+    const char *prefix = "";
+    bool ok;
+    if (changed_since != NULL){
+        ok = git_read_changed(root, changed_since, &paths);
+    } else {
+        ok = git_find_top(root, real, top, sizeof(top), &prefix) && git_dir(top, dir, sizeof(dir));
+        if (!ok) fprintf(stderr, "[ERROR] '%s' is not inside a git work tree!\n", root);
+        ok = ok && git_read_index(dir, &paths);
+    }
+    sb_append_char(&paths, '\0', 1);
+    size_t prefix_len = strlen(prefix);
+    char path[FILENAME_MAX];
+    for (const char *name = paths.items, *end = paths.items+paths.count; ok && name < end; name += strlen(name)+1){
+        const char *rel = name;
+        if (prefix_len > 0){
+            if (strncmp(name, prefix, prefix_len) != 0 || name[prefix_len] != '/') continue;
+            rel += prefix_len+1;
+        }
+        if (*rel == '\0' || git_path_skipped(ignore, root, rel)) continue;
+        pool_seed(pool, Task_File, join_path(root, rel, path, sizeof(path)), NULL);
+    }
+    clags_sb_free(&paths);
+    return ok;
+}
+
+void pool_run(pool_t *pool)
+{
+    visited_clear(pool);
+    if (pool->sort){
+        pool->sorter.root.ready = true;
+        pool->sorter.cursor = &pool->sorter.root;
+    }
+    for (size_t i=0; i<pool->count && pool->stats; ++i){
+        pool->workers[i].stats.phase_start = clock_ns();
+    }
+    if (pool->count == 1){
+        // take the roots from the top to search them in the order they were given
+        worker_t *worker = &pool->workers[0];
+        task_t task;
+        while (deque_steal(&worker->deque, &task)){
+            atomic_fetch_sub(&pool->queued, 1);
+            run_task(worker, task);
+            atomic_fetch_sub(&pool->pending, 1);
+        }
+        flush_output(&worker->out, pool->format);
+        return;
+    }
+    // workers that fail to start still have their deques emptied by the others
+    size_t started = 1;
+    for (; started<pool->count; ++started){
+        if (pthread_create(&pool->workers[started].thread, NULL, worker_main, &pool->workers[started]) != 0){
+            fprintf(stderr, "[ERROR] Could not start worker thread: %s!\n", strerror(errno));
+            break;
+        }
+    }
+    worker_main(&pool->workers[0]);
+    for (size_t i=1; i<started; ++i){
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (size_t i=0; i<pool->count; ++i){
+        flush_output(&pool->workers[i].out, pool->format);
+    }
+}
+
+// merge the counters of all workers and report them on stderr
+void stats_print(const pool_t *pool, uint64_t elapsed_ns)
+{
+    stats_t total = {0};
+    for (size_t i=0; i<pool->count; ++i){
+        const stats_t *stats = &pool->workers[i].stats;
+        total.dirs += stats->dirs;
+        total.entries += stats->entries;
+        total.stats += stats->stats;
+        total.files += stats->files;
+        total.bytes_read += stats->bytes_read;
+        total.bytes_skipped += stats->bytes_skipped;
+        total.matches += stats->matches;
+        total.duplicates += stats->duplicates;
+        for (size_t phase=0; phase<Phase_Count; ++phase) total.phase_ns[phase] += stats->phase_ns[phase];
+    }
+    fprintf(stderr, "[STATS] %" PRIu64 " directories opened, %" PRIu64 " entries read, %" PRIu64 " stats issued, %" PRIu64 " duplicates skipped\n",
+            total.dirs, total.entries, total.stats, total.duplicates);
+    fprintf(stderr, "[STATS] %" PRIu64 " files scanned, %" PRIu64 " bytes read, %" PRIu64 " bytes skipped, %" PRIu64 " matches\n",
+            total.files, total.bytes_read, total.bytes_skipped, total.matches);
+    fprintf(stderr, "[STATS] %.3fs in search_dir, %.3fs in search_file, %.3fs matching over %zu worker(s), %.3fs elapsed\n",
+            total.phase_ns[Phase_Dir]/1e9, total.phase_ns[Phase_File]/1e9, total.phase_ns[Phase_Match]/1e9, pool->count, elapsed_ns/1e9);
+}
+
+indexed_file_t* index_find(index_t *index, const char *path, size_t path_len)
+{
+    if (index->slot_count == 0) return NULL;
+    size_t slot = hash_bytes(HASH_SEED, path, path_len) & (index->slot_count-1);
+    while (index->slots[slot] != 0){
+        indexed_file_t *file = &index->items[index->slots[slot]-1];
+        if (file->path_len == path_len && memcmp(file->path, path, path_len) == 0) return file;
+        slot = (slot+1) & (index->slot_count-1);
+    }
+    return NULL;
+}
+
+// replace the results of a file with a copy of `entry`, or mark the file as gone if `entry` is NULL
+void index_put(index_t *index, const char *path, size_t path_len, const cache_entry_t *entry)
+{
+    indexed_file_t *file = index_find(index, path, path_len);
+    if (file == NULL){
+        if (entry == NULL) return;
+        if (index->count == index->capacity){
+            index->capacity = index->capacity == 0 ? MATCHES_INIT_CAPACITY : index->capacity*2;
+            index->items = realloc(index->items, index->capacity*sizeof(*index->items));
+            assert(index->items != NULL && "Out of memory!");
+        }
+        if ((index->count+1)*2 > index->slot_count){
+            free(index->slots);
+            index->slot_count = index->slot_count == 0 ? MATCHES_INIT_CAPACITY : index->slot_count*2;
+            index->slots = calloc(index->slot_count, sizeof(*index->slots));
+            assert(index->slots != NULL && "Out of memory!");
+            for (size_t i=0; i<index->count; ++i){
+                size_t slot = hash_bytes(HASH_SEED, index->items[i].path, index->items[i].path_len) & (index->slot_count-1);
+                while (index->slots[slot] != 0) slot = (slot+1) & (index->slot_count-1);
+                index->slots[slot] = i+1;
+            }
+        }
+        size_t slot = hash_bytes(HASH_SEED, path, path_len) & (index->slot_count-1);
+        while (index->slots[slot] != 0) slot = (slot+1) & (index->slot_count-1);
+        index->slots[slot] = index->count+1;
+        file = &index->items[index->count++];
+        memset(file, 0, sizeof(*file));
+        file->path = strndup(path, path_len);
+        assert(file->path != NULL && "Out of memory!");
+        file->path_len = path_len;
+    }
+    free(file->record);
+    file->record = NULL;
+    memset(&file->entry, 0, sizeof(file->entry));
+    if (entry != NULL){
+        file->record = malloc(entry->record_size);
+        assert(file->record != NULL && "Out of memory!");
+        memcpy(file->record, entry->record, entry->record_size);
+        reader_t reader = {.data=file->record, .size=entry->record_size};
+        (void) cache_parse_entry(&reader, &file->entry);
+    }
+}
+
+void index_free(index_t *index)
+{
+    for (size_t i=0; i<index->count; ++i){
+        free(index->items[i].path);
+        free(index->items[i].record);
+    }
+    free(index->items);
+    free(index->slots);
+}
+
+int compare_records(const void *a, const void *b)
+{
+    const cache_entry_t *x = a, *y = b;
+    int order = memcmp(x->path, y->path, x->path_len < y->path_len ? x->path_len : y->path_len);
+    if (order != 0) return order;
+    return x->path_len < y->path_len ? -1 : x->path_len > y->path_len;
+}
+
+int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+// the entries the workers recorded in their `index_out` during the last run, sorted by path
+cache_entry_t* collect_records(pool_t *pool, size_t *count)
+{
+    size_t capacity = MATCHES_INIT_CAPACITY;
+    cache_entry_t *records = malloc(capacity*sizeof(*records));
+    assert(records != NULL && "Out of memory!");
+    *count = 0;
+    for (size_t i=0; i<pool->count; ++i){
+        const clags_sb_t *out = &pool->workers[i].index_out;
+        reader_t reader = {.data=out->items, .size=out->count};
+        while (reader.offset < reader.size){
+            if (*count == capacity){
+                capacity *= 2;
+                records = realloc(records, capacity*sizeof(*records));
+                assert(records != NULL && "Out of memory!");
+            }
+            memset(&records[*count], 0, sizeof(*records));
+            if (!cache_parse_entry(&reader, &records[*count])) break;
+            *count += 1;
+        }
+    }
+    qsort(records, *count, sizeof(*records), compare_records);
+    return records;
+}
+
+// forget what the workers recorded and the paths of their tasks, before the next run
+void pool_reset(pool_t *pool)
+{
+    for (size_t i=0; i<pool->count; ++i){
+        pool->workers[i].index_out.count = 0;
+        arena_reset(&pool->workers[i].arena);
+    }
+}
+
+// print the matches of a file that were removed and added. matches are told apart by their tag and text only,
+// so a line that merely moved is not reported
+void watch_diff(worker_t *worker, const char *path, const cache_entry_t *before, const cache_entry_t *after)
+{
+    arena_t *arena = &worker->file_arena;
+    arena_reset(arena);
+    match_list_t old = {.arena=arena}, new = {.arena=arena};
+    if (before != NULL) cache_entry_matches(before, &old);
+    if (after != NULL) cache_entry_matches(after, &new);
+    bool *kept = arena_alloc(arena, old.count + 1);
+    memset(kept, 0, old.count + 1);
+    match_list_t added = {.arena=arena}, removed = {.arena=arena};
+    // the search starts after the last match that was found, files that barely changed take linear time
+    size_t from = 0;
+    for (size_t i=0; i<new.count; ++i){
+        const match_t *match = &new.items[i];
+        bool found = false;
+        for (size_t k=0; k<old.count && !found; ++k){
+            size_t j = (from+k)%old.count;
+            const match_t *other = &old.items[j];
+            if (kept[j] || other->pattern != match->pattern || other->text_len != match->text_len) continue;
+            if (memcmp(other->text, match->text, match->text_len) != 0) continue;
+            kept[j] = found = true;
+            from = j+1;
+        }
+        if (!found) matches_append(&added, *match);
+    }
+    for (size_t j=0; j<old.count; ++j){
+        if (!kept[j]) matches_append(&removed, old.items[j]);
+    }
+    worker->matches = removed;
+    print_matches(worker, path, Change_Removed);
+    worker->matches = added;
+    print_matches(worker, path, Change_Added);
+    worker->matches = (match_list_t){.arena=arena};
+}
+
+// the slot of a watch descriptor, grown as needed
+watched_t* watched_at(watched_list_t *list, size_t index)
+{
+    if (index >= list->capacity){
+        size_t capacity = list->capacity == 0 ? MATCHES_INIT_CAPACITY : list->capacity;
+        while (capacity <= index) capacity *= 2;
+        list->items = realloc(list->items, capacity*sizeof(*list->items));
+        assert(list->items != NULL && "Out of memory!");
+        memset(list->items + list->capacity, 0, (capacity - list->capacity)*sizeof(*list->items));
+        list->capacity = capacity;
+    }
+    if (index >= list->count) list->count = index+1;
+    return &list->items[index];
+}
+
+void watched_clear(watched_t *watched)
+{
+    free(watched->path);
+    ignore_release(watched->ignore);
+    memset(watched, 0, sizeof(*watched));
+}
+
+void watch_changed(watch_t *watch, const char *path)
+{
+    sb_append(&watch->changed, path, strlen(path) + 1);
+}
+
+#ifdef TOD_INOTIFY
+void watch_add(watch_t *watch, const char *path, ignore_t *ignore, bool is_dir)
+{
+    uint32_t mask = is_dir
+        ? IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR
+        : IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ATTRIB;
+    int wd = inotify_add_watch(watch->fd, path, mask);
+    if (wd == -1){
+        if (errno != ENOENT) fprintf(stderr, "[WARNING] Could not watch '%s': %s!\n", path, strerror(errno));
+        return;
+    }
+    watched_t *watched = watched_at(&watch->dirs, wd);
+    watched_clear(watched);
+    watched->path = strdup(path);
+    assert(watched->path != NULL && "Out of memory!");
+    watched->ignore = ignore_retain(ignore);
+    watched->is_dir = is_dir;
+}
+#endif // TOD_INOTIFY
+
+void watch_walk_dir(watch_t *watch, const char *dirname, ignore_t *ignore, bool all)
+{
+    pool_t *pool = watch->pool;
+    int fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    struct stat dir_attr;
+    if (dir == NULL || fstat(fd, &dir_attr) == -1 || !visit(pool, &dir_attr)){
+        // it may be gone already, the next event tells
+        if (dir != NULL) closedir(dir);
+        else if (fd != -1) close(fd);
+        return;
+    }
+    int dir_fd = dirfd(dir);
+    if (pool->gitignore) ignore = ignore_load(ignore, dir_fd, dirname);
+    else ignore = ignore_retain(ignore);
+#ifdef TOD_INOTIFY
+    if (watch->fd != -1) watch_add(watch, dirname, ignore, true);
+#endif // TOD_INOTIFY
+    struct dirent *entry;
+    char path[FILENAME_MAX];
+    while ((entry = readdir(dir))){
+        struct stat attr;
+        bool have_attr;
+        entry_kind_t kind = classify_entry(&pool->workers[0], dir_fd, dirname, dir_attr.st_dev, ignore, entry, &attr, &have_attr);
+        if (kind == Entry_Skip) continue;
+        join_path(dirname, entry->d_name, path, sizeof(path));
+        if (kind == Entry_Dir){
+            watch_walk_dir(watch, path, ignore, all);
+        } else if (all){
+            watch_changed(watch, path);
+        } else if (watch->fd == -1){
+            if (!have_attr && fstatat(dir_fd, entry->d_name, &attr, 0) == -1) continue;
+            indexed_file_t *file = index_find(&watch->index, path, strlen(path));
+            if (file != NULL) file->seen = true;
+            if (file == NULL || file->record == NULL || !cache_entry_current(&file->entry, &attr)) watch_changed(watch, path);
+        }
+    }
+    closedir(dir);
+    ignore_release(ignore);
+}
+
+// walk a directory the way `search_dir` does, watching it and the directories below it. the files in it are
+// searched again if `all` is set, and when polling, those that changed since they were indexed
+void watch_walk(watch_t *watch, const char *dirname, ignore_t *ignore, bool all)
+{
+    // runs between scans, so the set of visited directories is free to guard this walk against link loops
+    visited_clear(watch->pool);
+    watch_walk_dir(watch, dirname, ignore, all);
+}
+
+// search everything below the roots again, when events were lost
+void watch_rescan(watch_t *watch)
+{
+    for (size_t i=0; i<watch->index.count; ++i){
+        if (watch->index.items[i].record != NULL) watch_changed(watch, watch->index.items[i].path);
+    }
+    for (size_t i=0; i<watch->roots.count; ++i){
+        watched_t *root = &watch->roots.items[i];
+        if (root->is_dir) watch_walk(watch, root->path, root->ignore, true);
+        else watch_changed(watch, root->path);
+    }
+}
 
-#include <cwalk.h>
-#define CLAGS_IMPLEMENTATION
-#include <clags.h>
+// collect what changed since the last walk, without inotify
+void watch_poll(watch_t *watch)
+{
+    for (size_t i=0; i<watch->index.count; ++i) watch->index.items[i].seen = false;
+    for (size_t i=0; i<watch->roots.count; ++i){
+        watched_t *root = &watch->roots.items[i];
+        if (root->is_dir){
+            watch_walk(watch, root->path, root->ignore, false);
+            continue;
+        }
+        struct stat attr;
+        indexed_file_t *file = index_find(&watch->index, root->path, strlen(root->path));
+        if (file != NULL) file->seen = true;
+        if (stat(root->path, &attr) == -1 ? file != NULL && file->record != NULL
+                                          : file == NULL || file->record == NULL || !cache_entry_current(&file->entry, &attr)){
+            watch_changed(watch, root->path);
+        }
+    }
+    // what was not seen is gone
+    for (size_t i=0; i<watch->index.count; ++i){
+        indexed_file_t *file = &watch->index.items[i];
+        if (!file->seen && file->record != NULL) watch_changed(watch, file->path);
+    }
+}
 
-#define MAX_LINE_LEN 4096
-#define ALPHABET_SIZE 256
+#ifdef TOD_INOTIFY
+// forget a directory that was deleted or moved away, with everything indexed and watched below it
+void watch_drop_dir(watch_t *watch, const char *dirname)
+{
+    size_t len = strlen(dirname);
+    for (size_t i=0; i<watch->index.count; ++i){
+        indexed_file_t *file = &watch->index.items[i];
+        if (file->record != NULL && file->path_len > len && memcmp(file->path, dirname, len) == 0 && file->path[len] == '/'){
+            watch_changed(watch, file->path);
+        }
+    }
+    for (size_t wd=0; wd<watch->dirs.count; ++wd){
+        watched_t *watched = &watch->dirs.items[wd];
+        if (watched->path == NULL || strncmp(watched->path, dirname, len) != 0) continue;
+        if (watched->path[len] != '\0' && watched->path[len] != '/') continue;
+        (void) inotify_rm_watch(watch->fd, wd);
+        watched_clear(watched);
+    }
+}
 
-#define return_defer(value) do{result = (value); goto defer;}while(0)
+void watch_event(watch_t *watch, const struct inotify_event *event)
+{
+    if (event->mask & IN_Q_OVERFLOW){
+        watch_rescan(watch);
+        return;
+    }
+    if (event->wd < 0 || (size_t) event->wd >= watch->dirs.count) return;
+    watched_t *watched = &watch->dirs.items[event->wd];
+    if (watched->path == NULL) return;
+    if (event->mask & IN_IGNORED){
+        watched_clear(watched);
+        return;
+    }
+    if (!watched->is_dir){
+        watch_changed(watch, watched->path);
+        return;
+    }
+    if (event->len == 0) return;
+    const char *name = event->name;
+    bool is_dir = (event->mask & IN_ISDIR) != 0;
+    if (is_ignored(watched->ignore, watched->path, name, is_dir)) return;
+    char path[FILENAME_MAX];
+    join_path(watched->path, name, path, sizeof(path));
+    if (!is_dir){
+        // sockets, pipes and links to directories are not searched, files that are gone already are. without
+        // --follow=always links are skipped like the walk skips them
+        struct stat attr;
+        int found = watch->pool->follow ? stat(path, &attr) : lstat(path, &attr);
+        if (found == 0 && !S_ISREG(attr.st_mode)) return;
+        watch_changed(watch, path);
+        return;
+    }
+    if (*name == '.') return;
+    // `watch_walk` may move `watched`
+    ignore_t *ignore = watched->ignore;
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) watch_drop_dir(watch, path);
+    if (event->mask & (IN_CREATE | IN_MOVED_TO)) watch_walk(watch, path, ignore, true);
+}
 
-const char* skip_spaces(const char *s)
+// handle the events that are ready
+void watch_read(watch_t *watch)
 {
-    while (isspace(*s)) ++s;
-    return s;
+    union{
+        struct inotify_event event;
+        char bytes[64*1024];
+    } buffer;
+    while (true){
+        ssize_t n = read(watch->fd, buffer.bytes, sizeof(buffer.bytes));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        for (ssize_t offset=0; offset<n;){
+            const struct inotify_event *event = (const struct inotify_event*) (buffer.bytes + offset);
+            watch_event(watch, event);
+            offset += sizeof(*event) + event->len;
+        }
+    }
+}
+#endif // TOD_INOTIFY
+
+void watch_init(watch_t *watch, pool_t *pool)
+{
+    memset(watch, 0, sizeof(*watch));
+    watch->pool = pool;
+    watch->fd = -1;
+#ifdef TOD_INOTIFY
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd == -1) fprintf(stderr, "[WARNING] Could not use inotify, polling for changes instead: %s!\n", strerror(errno));
+#endif // TOD_INOTIFY
+}
+
+// watch a root before it is searched, so no change made during the first scan is missed
+void watch_add_root(watch_t *watch, const char *path, ignore_t *ignore, bool is_dir)
+{
+    watched_t *root = watched_at(&watch->roots, watch->roots.count);
+    root->path = strdup(path);
+    assert(root->path != NULL && "Out of memory!");
+    root->ignore = ignore_retain(ignore);
+    root->is_dir = is_dir;
+#ifdef TOD_INOTIFY
+    if (watch->fd != -1){
+        if (is_dir) watch_walk(watch, path, ignore, false);
+        else watch_add(watch, path, NULL, false);
+    }
+#endif // TOD_INOTIFY
+}
+
+// index what the first scan found
+void watch_start(watch_t *watch)
+{
+    pool_t *pool = watch->pool;
+    size_t count;
+    cache_entry_t *records = collect_records(pool, &count);
+    for (size_t i=0; i<count; ++i) index_put(&watch->index, records[i].path, records[i].path_len, &records[i]);
+    free(records);
+    pool_reset(pool);
+    // what follows are diffs, searched by whoever is free
+    pool->quiet = true;
+    pool->sort = false;
+    pool->cache = NULL;
+    // the files that changed are searched again under the names they changed by
+    pool->revisit = true;
+}
+
+// wait until something below the roots changed; false if that cannot be watched anymore
+bool watch_wait(watch_t *watch)
+{
+    while (watch->changed.count == 0){
+#ifdef TOD_INOTIFY
+        if (watch->fd != -1){
+            struct pollfd ready = {.fd=watch->fd, .events=POLLIN};
+            if (poll(&ready, 1, -1) == -1){
+                if (errno == EINTR) continue;
+                fprintf(stderr, "[ERROR] Could not wait for changes: %s!\n", strerror(errno));
+                return false;
+            }
+            // editors and checkouts write many files at once, wait for them to settle
+            do watch_read(watch); while (poll(&ready, 1, WATCH_SETTLE_MS) > 0);
+            continue;
+        }
+#endif // TOD_INOTIFY
+        struct timespec delay = {WATCH_POLL_MS/1000, WATCH_POLL_MS%1000*1000000L};
+        nanosleep(&delay, NULL);
+        watch_poll(watch);
+    }
+    return true;
+}
+
+// search the changed files again and update the index; with `print` the matches added and removed are printed
+void watch_update(watch_t *watch, bool print)
+{
+    pool_t *pool = watch->pool;
+    size_t path_count = 0;
+    for (size_t offset=0; offset<watch->changed.count; offset += strlen(watch->changed.items+offset)+1) path_count++;
+    if (path_count == 0) return;
+    const char **paths = malloc(path_count*sizeof(*paths));
+    assert(paths != NULL && "Out of memory!");
+    path_count = 0;
+    for (size_t offset=0; offset<watch->changed.count; offset += strlen(watch->changed.items+offset)+1){
+        paths[path_count++] = watch->changed.items+offset;
+    }
+    qsort(paths, path_count, sizeof(*paths), compare_paths);
+    size_t unique = 0;
+    for (size_t i=0; i<path_count; ++i){
+        if (unique == 0 || strcmp(paths[unique-1], paths[i]) != 0) paths[unique++] = paths[i];
+    }
+    for (size_t i=0; i<unique; ++i) pool_seed(pool, Task_File, paths[i], NULL);
+    pool_run(pool);
+
+    size_t record_count;
+    cache_entry_t *records = collect_records(pool, &record_count);
+    worker_t *worker = &pool->workers[0];
+    for (size_t i=0; i<unique; ++i){
+        // files that are gone or cannot be read have no record
+        cache_entry_t key = {.path=paths[i], .path_len=strlen(paths[i])};
+        const cache_entry_t *record = bsearch(&key, records, record_count, sizeof(*records), compare_records);
+        indexed_file_t *file = index_find(&watch->index, key.path, key.path_len);
+        if (print) watch_diff(worker, key.path, file != NULL ? &file->entry : NULL, record);
+        index_put(&watch->index, key.path, key.path_len, record);
+    }
+    flush_output(&worker->out, pool->format);
+    free(records);
+    free(paths);
+    pool_reset(pool);
+    watch->changed.count = 0;
+#ifdef TOD_INOTIFY
+    // a root file that was replaced lost its watch
+    for (size_t i=0; i<watch->roots.count && watch->fd != -1; ++i){
+        if (!watch->roots.items[i].is_dir) watch_add(watch, watch->roots.items[i].path, NULL, false);
+    }
+#endif // TOD_INOTIFY
+}
+
+void watch_free(watch_t *watch)
+{
+    index_free(&watch->index);
+    for (size_t i=0; i<watch->roots.count; ++i) watched_clear(&watch->roots.items[i]);
+    for (size_t i=0; i<watch->dirs.count; ++i) watched_clear(&watch->dirs.items[i]);
+    free(watch->roots.items);
+    free(watch->dirs.items);
+    clags_sb_free(&watch->changed);
+    if (watch->fd != -1) close(watch->fd);
+}
+
+static volatile sig_atomic_t serve_stopped = 0;
+
+void serve_stop(int signal)
+{
+    (void) signal;
+    serve_stopped = 1;
 }
 
-bool in_paths(clags_list_t paths, const char *item)
+// read a whole request, until the client shuts down its side; a client that stalls is dropped
+bool serve_read(int fd, clags_sb_t *request)
 {
-    for (size_t i=0; i<paths.count; ++i){
-        if (strcmp(item, clags_list_element(paths, char*, i)) == 0) return true;
+    char chunk[READ_CHUNK_SIZE];
+    while (request->count <= SERVE_MAX_REQUEST){
+        struct pollfd ready = {.fd=fd, .events=POLLIN};
+        int n = poll(&ready, 1, SERVE_TIMEOUT_MS);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        ssize_t count = read(fd, chunk, sizeof(chunk));
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0) return false;
+        if (count == 0) return true;
+        sb_append(request, chunk, count);
     }
     return false;
 }
 
-void setup_shift_table(const char *needle, int needle_len, int shift_table[])
+int compare_indexed(const void *a, const void *b)
+{
+    return strcmp((*(const indexed_file_t* const*) a)->path, (*(const indexed_file_t* const*) b)->path);
+}
+
+// answer one query with the indexed matches; the request is a list of NUL terminated fields:
+// version, mode, format, caret, then 'p' and a pattern or tag to keep, or 'r' and a root to keep, any number of times.
+// the response is '0' and the output, or '1' and an error message
+void serve_client(watch_t *watch, int fd)
 {
-    for (int i = 0; i < ALPHABET_SIZE; i++) {
-        shift_table[i] = needle_len;
+    pool_t *pool = watch->pool;
+    const matcher_t *matcher = pool->matcher;
+    worker_t *worker = &pool->workers[0];
+    clags_sb_t request = {0};
+    clags_sb_t *out = &worker->out;
+    out->count = 0;
+    const char *fields[4] = {0};
+    size_t field_count = 0;
+    bool ok = serve_read(fd, &request);
+    sb_append_char(&request, '\0', 1);
+    const char *end = request.items + request.count - 1;
+    const char *field = request.items;
+    for (; ok && field < end && field_count < 4; field += strlen(field)+1) fields[field_count++] = field;
+    if (!ok || field_count < 4 || strcmp(fields[0], SERVE_PROTOCOL) != 0 ||
+        atoi(fields[1]) < Search_Lines || atoi(fields[1]) > Search_First || atoi(fields[2]) < Format_Text || atoi(fields[2]) > Format_Sarif){
+        sb_append_cstr(out, "1[ERROR] Malformed query!\n");
+        (void) write_all(fd, out->items, out->count);
+        out->count = 0;
+        clags_sb_free(&request);
+        return;
     }
-    for (int i = 0; i < needle_len - 1; i++) {
-        shift_table[(unsigned char)needle[i]] = needle_len - i - 1;
+    // which patterns are kept, all of them unless some are named. a name the server does not know is an error,
+    // the empty answer would read as no matches
+    bool *wanted = calloc(matcher->count, sizeof(*wanted));
+    assert(wanted != NULL && "Out of memory!");
+    bool any_pattern = false, any_root = false;
+    for (const char *f = field; f < end; f += strlen(f)+1){
+        any_pattern |= f[0] == 'p';
+        any_root |= f[0] == 'r';
+        bool known = f[0] != 'p';
+        for (size_t i=0; i<matcher->count && f[0] == 'p'; ++i){
+            if (strcmp(f+1, matcher->patterns[i]) == 0 || strcmp(f+1, matcher->tags[i]) == 0) wanted[i] = known = true;
+        }
+        if (!known){
+            sb_append_cstr(out, "1[ERROR] Unknown pattern or tag '");
+            sb_append_cstr(out, f+1);
+            sb_append_cstr(out, "'!\n");
+            (void) write_all(fd, out->items, out->count);
+            out->count = 0;
+            free(wanted);
+            clags_sb_free(&request);
+            return;
+        }
+    }
+    for (size_t i=0; i<matcher->count && !any_pattern; ++i) wanted[i] = true;
+
+    search_mode_t mode = pool->mode;
+    format_t format = pool->format;
+    bool caret = pool->caret;
+    pool->mode = atoi(fields[1]);
+    pool->format = atoi(fields[2]);
+    pool->caret = strcmp(fields[3], "1") == 0;
+
+    // the files in path order, so the same query always gets the same answer
+    const indexed_file_t **files = malloc((watch->index.count + 1)*sizeof(*files));
+    assert(files != NULL && "Out of memory!");
+    size_t file_count = 0;
+    for (size_t i=0; i<watch->index.count; ++i){
+        const indexed_file_t *file = &watch->index.items[i];
+        if (file->record == NULL || file->entry.match_count == 0) continue;
+        bool under = !any_root;
+        for (const char *f = field; f < end && !under; f += strlen(f)+1){
+            under = f[0] == 'r' && path_under(file->path, file->path_len, f+1);
+        }
+        if (under) files[file_count++] = file;
+    }
+    qsort(files, file_count, sizeof(*files), compare_indexed);
+
+    sb_append_char(out, '0', 1);
+    format_header(pool, out);
+    bool any_records = false;
+    for (size_t i=0; i<file_count; ++i){
+        arena_reset(&worker->file_arena);
+        worker->matches = (match_list_t){.arena=&worker->file_arena};
+        cache_entry_matches(&files[i]->entry, &worker->matches);
+        size_t kept = 0;
+        for (size_t j=0; j<worker->matches.count; ++j){
+            if (wanted[worker->matches.items[j].pattern]) worker->matches.items[kept++] = worker->matches.items[j];
+        }
+        worker->matches.count = kept;
+        if (kept == 0) continue;
+        size_t before = out->count;
+        print_matches(worker, files[i]->path, Change_None);
+        // like `write_output`, the separator in front of the first SARIF result is dropped
+        if (!any_records && pool->format == Format_Sarif){
+            memmove(out->items+before, out->items+before+1, out->count-before-1);
+            out->count -= 1;
+        }
+        any_records = true;
+        if (out->count >= OUTPUT_BUFFER_SIZE){
+            if (!write_all(fd, out->items, out->count)) break;
+            out->count = 0;
+        }
     }
+    format_footer(pool, out, any_records);
+    (void) write_all(fd, out->items, out->count);
+    out->count = 0;
+    worker->matches = (match_list_t){.arena=&worker->file_arena};
+    pool->mode = mode;
+    pool->format = format;
+    pool->caret = caret;
+    free(files);
+    free(wanted);
+    clags_sb_free(&request);
 }
 
-void search_line(const char *filename, const char *line, int line_len, const char *needle, int line_number)
+// keep the index up to date and answer queries on the Unix socket `path` until interrupted
+bool serve(watch_t *watch, const char *path)
 {
-    int needle_len = strlen(needle);
-    if (needle_len == 0 || needle_len > line_len) return;
+    struct sockaddr_un address = {.sun_family=AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)){
+        fprintf(stderr, "[ERROR] The socket path '%s' is too long!\n", path);
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1){
+        fprintf(stderr, "[ERROR] Could not create socket: %s!\n", strerror(errno));
+        return false;
+    }
+    // a socket nobody listens on is left over from a server that did not exit cleanly
+    if (connect(listen_fd, (struct sockaddr*) &address, sizeof(address)) == 0){
+        fprintf(stderr, "[ERROR] Another server is already listening on '%s'!\n", path);
+        close(listen_fd);
+        return false;
+    }
+    (void) unlink(path);
+    close(listen_fd);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(listen_fd, SOMAXCONN) == -1){
+        fprintf(stderr, "[ERROR] Could not listen on '%s': %s!\n", path, strerror(errno));
+        if (listen_fd != -1) close(listen_fd);
+        return false;
+    }
+    struct sigaction action = {0};
+    action.sa_handler = serve_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    // clients that hang up early must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "[INFO] Indexed %zu files, serving queries on '%s'\n", watch->index.count, path);
 
-    int shift_table[ALPHABET_SIZE];
-    setup_shift_table(needle, needle_len, shift_table);
+    bool result = true;
+    while (!serve_stopped){
+        struct pollfd ready[2] = {{.fd=listen_fd, .events=POLLIN}, {.fd=watch->fd, .events=POLLIN}};
+        nfds_t count = watch->fd != -1 ? 2 : 1;
+        int n = poll(ready, count, watch->fd != -1 ? -1 : WATCH_POLL_MS);
+        if (n < 0){
+            if (errno == EINTR) continue;
+            fprintf(stderr, "[ERROR] Could not wait for queries: %s!\n", strerror(errno));
+            result = false;
+            break;
+        }
+#ifdef TOD_INOTIFY
+        if (count == 2 && (ready[1].revents & POLLIN)){
+            do watch_read(watch); while (poll(&ready[1], 1, WATCH_SETTLE_MS) > 0);
+        }
+#endif // TOD_INOTIFY
+        if (watch->fd == -1 && n == 0) watch_poll(watch);
+        watch_update(watch, false);
+        if (ready[0].revents & POLLIN){
+            int client = accept(listen_fd, NULL, NULL);
+            if (client != -1){
+                serve_client(watch, client);
+                close(client);
+            }
+        }
+    }
+    close(listen_fd);
+    (void) unlink(path);
+    return result;
+}
 
-    int i = 0;
-    while (i <= line_len - needle_len) {
-        int j = needle_len - 1;
-        while (j >= 0 && needle[j] == line[i + j]) {
-            j--;
+// send a query to a running server and print its answer
+bool query(const char *path, const pool_t *pool, clags_list_t patterns, clags_list_t roots)
+{
+    struct sockaddr_un address = {.sun_family=AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)){
+        fprintf(stderr, "[ERROR] The socket path '%s' is too long!\n", path);
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*) &address, sizeof(address)) == -1){
+        fprintf(stderr, "[ERROR] Could not connect to '%s', is `tod --serve` running?: %s!\n", path, strerror(errno));
+        if (fd != -1) close(fd);
+        return false;
+    }
+    clags_sb_t request = {0};
+    char field[FILENAME_MAX + 1];
+    snprintf(field, sizeof(field), "%s", SERVE_PROTOCOL);
+    sb_append(&request, field, strlen(field)+1);
+    snprintf(field, sizeof(field), "%d", (int) pool->mode);
+    sb_append(&request, field, strlen(field)+1);
+    snprintf(field, sizeof(field), "%d", (int) pool->format);
+    sb_append(&request, field, strlen(field)+1);
+    sb_append(&request, pool->caret ? "1" : "0", 2);
+    for (size_t i=0; i<patterns.count; ++i){
+        sb_append_char(&request, 'p', 1);
+        sb_append(&request, clags_list_element(patterns, char*, i), strlen(clags_list_element(patterns, char*, i))+1);
+    }
+    // the roots are matched against the paths as the server prints them
+    for (size_t i=0; i<roots.count; ++i){
+        field[0] = 'r';
+        cwk_path_normalize(clags_list_element(roots, char*, i), field+1, sizeof(field)-1);
+        sb_append(&request, field, strlen(field)+1);
+    }
+    bool result = write_all(fd, request.items, request.count) && shutdown(fd, SHUT_WR) == 0;
+    clags_sb_free(&request);
+    char chunk[READ_CHUNK_SIZE];
+    ssize_t n;
+    int out_fd = -1;
+    while (result && (n = read(fd, chunk, sizeof(chunk))) != 0){
+        if (n < 0){
+            if (errno == EINTR) continue;
+            result = false;
+            break;
         }
-        if (j < 0) {
-            int format_len = printf("%s:%d:%d: ", filename, line_number, i+1);
-            const char *trimmed = skip_spaces(line);
-            printf("%s\n%*s^\n", trimmed, format_len+i-(int)(trimmed-line), "");
-            i += needle_len;
-        } else {
-            unsigned char mismatched_char = line[i + needle_len - 1];
-            i += shift_table[mismatched_char];
+        size_t skip = 0;
+        if (out_fd == -1){
+            result = chunk[0] == '0';
+            out_fd = result ? STDOUT_FILENO : STDERR_FILENO;
+            skip = 1;
         }
+        (void) write_all(out_fd, chunk+skip, n-skip);
     }
+    if (out_fd == -1 && result){
+        fprintf(stderr, "[ERROR] The server closed the connection without an answer!\n");
+        result = false;
+    }
+    close(fd);
+    return result && out_fd == STDOUT_FILENO;
 }
 
-int search_file(const char *filename, const char *needle)
+// a file written with --format=partial, mapped while its matches are printed
+typedef struct{
+    const char *path;
+    void *blob;
+    size_t blob_size;
+    uint64_t fingerprint;
+    uint32_t shard;
+    uint32_t shard_count;
+    clags_list_t patterns;  // point into `blob`
+    reader_t entries;       // the serialized entries after the header
+} partial_t;
+
+// map a partial result and parse its header, written by `format_header`
+bool partial_load(partial_t *partial, const char *path)
 {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL){
-        fprintf(stderr, "[ERROR] Could not open file '%s': %s!\n", filename, strerror(errno));
-        return 1;
+    memset(partial, 0, sizeof(*partial));
+    partial->path = path;
+    partial->patterns = clags_list();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat attr;
+    if (fd == -1 || fstat(fd, &attr) == -1){
+        fprintf(stderr, "[ERROR] Could not open '%s': %s!\n", path, strerror(errno));
+        if (fd != -1) close(fd);
+        return false;
     }
-    char line[MAX_LINE_LEN];
-    int line_number = 1;
-    
-    while (fgets(line, sizeof(line), file)){
-        size_t line_len = strlen(line);
-        if (line_len > 0 && (line[line_len-1] == '\n' || line[line_len-1] == '\r')){
-            line[--line_len] = '\0';
+    if (attr.st_size > 0){
+        void *blob = mmap(NULL, attr.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (blob != MAP_FAILED){
+            partial->blob = blob;
+            partial->blob_size = attr.st_size;
         }
-        search_line(filename, line, line_len, needle, line_number);
-        line_number++;
     }
-    fclose(file);
-    return 0;
+    close(fd);
+    reader_t reader = {.data=partial->blob, .size=partial->blob_size};
+    const char *magic = reader_take(&reader, 4);
+    bool ok = magic != NULL && memcmp(magic, PARTIAL_MAGIC, 4) == 0 && reader_u32(&reader) == CACHE_VERSION;
+    partial->fingerprint = reader_u64(&reader);
+    partial->shard = reader_u32(&reader);
+    partial->shard_count = reader_u32(&reader);
+    uint32_t count = reader_u32(&reader);
+    ok = ok && !reader.failed && partial->shard < partial->shard_count && count > 0 && count <= reader.size;
+    if (ok){
+        partial->patterns.items = calloc(count, sizeof(char*));
+        assert(partial->patterns.items != NULL && "Out of memory!");
+        partial->patterns.capacity = count;
+    }
+    for (uint32_t i=0; ok && i<count; ++i){
+        uint32_t length = reader_u32(&reader);
+        const char *pattern = reader_take(&reader, (size_t) length+1);
+        ok = pattern != NULL && pattern[length] == '\0';
+        clags_list_element(partial->patterns, const char*, partial->patterns.count++) = pattern;
+    }
+    if (!ok){
+        fprintf(stderr, "[ERROR] '%s' is not a result written with --format=partial!\n", path);
+        return false;
+    }
+    partial->entries = (reader_t){.data=reader.data+reader.offset, .size=reader.size-reader.offset};
+    return true;
 }
 
-int search_dir(const char *dirname, const char *needle, clags_list_t ignore)
+void partial_free(partial_t *partial)
 {
-    DIR *dir = opendir(dirname);
-    if (dir == NULL){
-        fprintf(stderr, "[ERROR] Could not open directory: '%s': %s!\n", dirname, strerror(errno));
-        return 1;
+    if (partial->blob != NULL) munmap(partial->blob, partial->blob_size);
+    free(partial->patterns.items);
+}
+
+int compare_matches(const void *a, const void *b)
+{
+    const match_t *x = a, *y = b;
+    if (x->line != y->line) return x->line < y->line ? -1 : 1;
+    if (x->column != y->column) return x->column < y->column ? -1 : 1;
+    return x->pattern < y->pattern ? -1 : x->pattern > y->pattern;
+}
+
+// combine results written with --format=partial, by any number of shards, into one report in path order that
+// is printed with `format` and `mode`. a match found twice, by a shard that ran twice or by overlapping input
+// paths, is reported once
+bool merge(clags_list_t paths, format_t format, search_mode_t mode, bool caret)
+{
+    bool result = true;
+    size_t count = paths.count;
+    partial_t *partials = calloc(count, sizeof(*partials));
+    assert(partials != NULL && "Out of memory!");
+    size_t loaded = 0;
+    for (; loaded<count && result; ++loaded){
+        result = partial_load(&partials[loaded], clags_list_element(paths, char*, loaded));
+        const partial_t *first = &partials[0], *partial = &partials[loaded];
+        if (result && (partial->fingerprint != first->fingerprint || partial->shard_count != first->shard_count)){
+            fprintf(stderr, "[ERROR] '%s' was not written with the same patterns, options and shard count as '%s'!\n", partial->path, first->path);
+            result = false;
+        }
     }
-    
-    struct dirent *entry;
-    char item_path[FILENAME_MAX] = {0};
-    while ((entry = readdir(dir))){
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
-        if (in_paths(ignore, entry->d_name)) continue;
-        cwk_path_join(dirname, entry->d_name, item_path, sizeof(item_path));
-        struct stat attr;
-        if (stat(item_path, &attr) == -1){
-            fprintf(stderr, "[ERROR] Could not access '%s': %s!\n", item_path, strerror(errno));
-            continue;
+    if (!result){
+        for (size_t i=0; i<loaded; ++i) partial_free(&partials[i]);
+        free(partials);
+        return false;
+    }
+
+    bool *seen = calloc(partials[0].shard_count, sizeof(*seen));
+    assert(seen != NULL && "Out of memory!");
+    size_t capacity = MATCHES_INIT_CAPACITY;
+    size_t record_count = 0;
+    cache_entry_t *records = malloc(capacity*sizeof(*records));
+    assert(records != NULL && "Out of memory!");
+    for (size_t i=0; i<count; ++i){
+        reader_t *reader = &partials[i].entries;
+        seen[partials[i].shard] = true;
+        while (reader->offset < reader->size){
+            if (record_count == capacity){
+                capacity *= 2;
+                records = realloc(records, capacity*sizeof(*records));
+                assert(records != NULL && "Out of memory!");
+            }
+            memset(&records[record_count], 0, sizeof(*records));
+            if (!cache_parse_entry(reader, &records[record_count])){
+                fprintf(stderr, "[ERROR] '%s' is truncated!\n", partials[i].path);
+                result = false;
+                break;
+            }
+            record_count++;
         }
-        if (S_ISDIR(attr.st_mode) && *entry->d_name != '.'){
-            (void) search_dir(item_path, needle, ignore);
-        }else if (S_ISREG(attr.st_mode)){
-            (void) search_file(item_path, needle);
-        }else{
-            continue;
+    }
+    for (size_t i=0; i<partials[0].shard_count; ++i){
+        if (!seen[i]) fprintf(stderr, "[WARNING] The results of shard %zu/%" PRIu32 " are missing!\n", i+1, partials[0].shard_count);
+    }
+    qsort(records, record_count, sizeof(*records), compare_records);
+
+    matcher_t matcher;
+    pool_t pool;
+    if (!matcher_init(&matcher, partials[0].patterns, false)) result = false;
+    pool_init(&pool, 1, &matcher);
+    pool.format = format;
+    pool.mode = mode;
+    pool.caret = caret;
+    pool.flush_size = OUTPUT_BUFFER_SIZE;
+    worker_t *worker = &pool.workers[0];
+    if (result) print_header(&pool);
+    for (size_t i=0; i<record_count && result;){
+        // a file may have several records: from several shards, or one per piece of a searched stream
+        size_t end = i+1;
+        while (end < record_count && compare_records(&records[i], &records[end]) == 0) ++end;
+        arena_reset(&worker->file_arena);
+        worker->matches = (match_list_t){.arena=&worker->file_arena};
+        for (size_t j=i; j<end; ++j) cache_entry_matches(&records[j], &worker->matches);
+        match_list_t *matches = &worker->matches;
+        qsort(matches->items, matches->count, sizeof(*matches->items), compare_matches);
+        size_t kept = 0;
+        for (size_t j=0; j<matches->count; ++j){
+            if (kept == 0 || compare_matches(&matches->items[kept-1], &matches->items[j]) != 0) matches->items[kept++] = matches->items[j];
         }
+        matches->count = kept;
+        char path[FILENAME_MAX];
+        snprintf(path, sizeof(path), "%.*s", (int) records[i].path_len, records[i].path);
+        if (kept > 0) print_matches(worker, path, Change_None);
+        finish_file(worker);
+        i = end;
     }
-    closedir(dir);
-    return 0;
+    flush_output(&worker->out, pool.format);
+    if (result) print_footer(&pool);
+    pool_free(&pool);
+    matcher_free(&matcher);
+    free(records);
+    free(seen);
+    for (size_t i=0; i<count; ++i) partial_free(&partials[i]);
+    free(partials);
+    return result;
+}
+
+// a match of a --format=bin file; records have a fixed width, so any of them is read without parsing the others
+typedef struct{
+    uint64_t text;         // the offset of the text in the text section
+    uint64_t line;
+    uint32_t path;         // the id of the path, its index in the path table
+    uint32_t pattern;      // the index of the pattern in the pattern table
+    uint32_t column;
+    uint32_t indent;
+    uint32_t text_len;
+    uint32_t owner;
+    uint32_t ticket;
+    uint8_t owner_len;
+    uint8_t ticket_len;
+    char priority;
+    uint8_t unused;
+} bin_record_t;
+
+// the header of a --format=bin file: where each section starts, all offsets are from the start of the file.
+// the paths are in path order, and the index holds the first record of every path plus the record count,
+// so the records of the paths below a prefix are found by a binary search
+typedef struct{
+    char magic[4];
+    uint32_t version;
+    uint32_t path_count;
+    uint32_t pattern_count;
+    uint64_t record_count;
+    uint64_t patterns;     // pattern_count times a u32 length and the pattern with its NUL terminator
+    uint64_t path_offsets; // path_count+1 u64 offsets into `paths`
+    uint64_t paths;
+    uint64_t index;        // path_count+1 u64 record numbers
+    uint64_t records;
+    uint64_t texts;
+    uint64_t size;
+} bin_header_t;
+
+static void sb_align(clags_sb_t *sb, size_t alignment)
+{
+    if (sb->count%alignment != 0) sb_append_char(sb, '\0', alignment - sb->count%alignment);
+}
+
+// write the matches every worker recorded as one --format=bin file to stdout
+bool bin_write(pool_t *pool)
+{
+    const matcher_t *matcher = pool->matcher;
+    size_t record_count = 0;
+    cache_entry_t *entries = collect_records(pool, &record_count);
+    clags_sb_t patterns = {0}, path_offsets = {0}, paths = {0}, index = {0}, records = {0}, texts = {0};
+    arena_t arena = {0};
+    for (size_t i=0; i<matcher->count; ++i){
+        sb_append_value(&patterns, uint32_t, matcher->lengths[i]);
+        sb_append(&patterns, matcher->patterns[i], matcher->lengths[i]+1);
+    }
+    uint32_t path_count = 0;
+    uint64_t match_count = 0;
+    for (size_t i=0; i<record_count;){
+        // a file searched as a stream has one entry per piece
+        size_t end = i+1;
+        while (end < record_count && compare_records(&entries[i], &entries[end]) == 0) ++end;
+        arena_reset(&arena);
+        match_list_t matches = {.arena=&arena};
+        for (size_t j=i; j<end; ++j) cache_entry_matches(&entries[j], &matches);
+        qsort(matches.items, matches.count, sizeof(*matches.items), compare_matches);
+        sb_append_value(&path_offsets, uint64_t, paths.count);
+        sb_append(&paths, entries[i].path, entries[i].path_len);
+        sb_append_value(&index, uint64_t, match_count);
+        for (size_t j=0; j<matches.count; ++j){
+            const match_t *match = &matches.items[j];
+            bin_record_t record = {
+                .text=texts.count, .line=match->line, .path=path_count, .pattern=match->pattern,
+                .column=match->column, .indent=match->indent, .text_len=match->text_len,
+                .owner=match->owner, .ticket=match->ticket, .owner_len=match->owner_len,
+                .ticket_len=match->ticket_len, .priority=match->priority,
+            };
+            sb_append(&records, &record, sizeof(record));
+            sb_append(&texts, match->text, match->text_len);
+        }
+        match_count += matches.count;
+        path_count += 1;
+        i = end;
+    }
+    sb_append_value(&path_offsets, uint64_t, paths.count);
+    sb_append_value(&index, uint64_t, match_count);
+
+    bin_header_t header = {.version=CACHE_VERSION, .path_count=path_count, .pattern_count=matcher->count, .record_count=match_count};
+    memcpy(header.magic, BIN_MAGIC, sizeof(header.magic));
+    clags_sb_t out = {0};
+    sb_append_char(&out, '\0', sizeof(header));
+    header.patterns = out.count;
+    sb_append(&out, patterns.items, patterns.count);
+    sb_align(&out, sizeof(uint64_t));
+    header.path_offsets = out.count;
+    sb_append(&out, path_offsets.items, path_offsets.count);
+    header.paths = out.count;
+    sb_append(&out, paths.items, paths.count);
+    sb_align(&out, sizeof(uint64_t));
+    header.index = out.count;
+    sb_append(&out, index.items, index.count);
+    header.records = out.count;
+    sb_append(&out, records.items, records.count);
+    header.texts = out.count;
+    sb_append(&out, texts.items, texts.count);
+    header.size = out.count;
+    memcpy(out.items, &header, sizeof(header));
+    bool ok = write_all(STDOUT_FILENO, out.items, out.count);
+    if (!ok) fprintf(stderr, "[ERROR] Could not write output: %s!\n", strerror(errno));
+    clags_sb_free(&out);
+    clags_sb_free(&patterns);
+    clags_sb_free(&path_offsets);
+    clags_sb_free(&paths);
+    clags_sb_free(&index);
+    clags_sb_free(&records);
+    clags_sb_free(&texts);
+    arena_free(&arena);
+    free(entries);
+    return ok;
+}
+
+// a --format=bin file mapped for `tod query`
+typedef struct{
+    const char *data;
+    size_t size;
+    bin_header_t header;
+    const uint64_t *path_offsets;
+    const uint64_t *index;
+    clags_list_t patterns;  // point into `data`
+} bin_file_t;
+
+// whether `count` items of `size` bytes at `offset` lie within the file
+static inline bool bin_fits(const bin_file_t *bin, uint64_t offset, uint64_t count, uint64_t size)
+{
+    return offset <= bin->size && count <= (bin->size - offset)/size;
+}
+
+// map a --format=bin file and check its header; the records are only read when they are printed
+bool bin_open(bin_file_t *bin, const char *path)
+{
+    memset(bin, 0, sizeof(*bin));
+    bin->patterns = clags_list();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat attr;
+    if (fd == -1 || fstat(fd, &attr) == -1){
+        fprintf(stderr, "[ERROR] Could not open '%s': %s!\n", path, strerror(errno));
+        if (fd != -1) close(fd);
+        return false;
+    }
+    void *data = attr.st_size > 0 ? mmap(NULL, attr.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data != MAP_FAILED){
+        bin->data = data;
+        bin->size = attr.st_size;
+    }
+    bin_header_t *header = &bin->header;
+    bool ok = bin->size >= sizeof(*header);
+    if (ok) memcpy(header, bin->data, sizeof(*header));
+    ok = ok && memcmp(header->magic, BIN_MAGIC, 4) == 0 && header->version == CACHE_VERSION && header->size == bin->size &&
+         header->pattern_count > 0 && header->path_offsets%sizeof(uint64_t) == 0 && header->index%sizeof(uint64_t) == 0 &&
+         header->records%sizeof(uint64_t) == 0 && bin_fits(bin, header->path_offsets, (uint64_t) header->path_count+1, sizeof(uint64_t)) &&
+         bin_fits(bin, header->index, (uint64_t) header->path_count+1, sizeof(uint64_t)) &&
+         bin_fits(bin, header->records, header->record_count, sizeof(bin_record_t)) && header->texts <= bin->size;
+    if (ok){
+        bin->path_offsets = (const uint64_t*) (bin->data+header->path_offsets);
+        bin->index = (const uint64_t*) (bin->data+header->index);
+        ok = bin->index[header->path_count] == header->record_count && bin_fits(bin, header->paths, bin->path_offsets[header->path_count], 1);
+    }
+    reader_t reader = {.data=bin->data, .size=ok ? bin->size : 0, .offset=header->patterns};
+    for (uint32_t i=0; ok && i<header->pattern_count; ++i){
+        uint32_t length = reader_u32(&reader);
+        const char *pattern = reader_take(&reader, (size_t) length+1);
+        ok = pattern != NULL && pattern[length] == '\0';
+        if (!ok) break;
+        if (bin->patterns.count == bin->patterns.capacity){
+            bin->patterns.capacity = bin->patterns.capacity == 0 ? MATCHES_INIT_CAPACITY : bin->patterns.capacity*2;
+            bin->patterns.items = realloc(bin->patterns.items, bin->patterns.capacity*sizeof(char*));
+            assert(bin->patterns.items != NULL && "Out of memory!");
+        }
+        clags_list_element(bin->patterns, const char*, bin->patterns.count++) = pattern;
+    }
+    if (!ok) fprintf(stderr, "[ERROR] '%s' is not a result written with --format=bin!\n", path);
+    return ok;
+}
+
+void bin_close(bin_file_t *bin)
+{
+    if (bin->data != NULL) munmap((void*) bin->data, bin->size);
+    free(bin->patterns.items);
+}
+
+// the path with the id `id`; NULL if its offsets are out of order
+const char* bin_path(const bin_file_t *bin, uint32_t id, size_t *len)
+{
+    uint64_t start = bin->path_offsets[id], end = bin->path_offsets[id+1];
+    if (start > end || end > bin->path_offsets[bin->header.path_count]) return NULL;
+    *len = end-start;
+    return bin->data+bin->header.paths+start;
+}
+
+// the first path id not below `prefix`, or after all paths starting with it with `after`
+uint32_t bin_search(const bin_file_t *bin, const char *prefix, bool after)
+{
+    size_t prefix_len = strlen(prefix);
+    uint32_t low = 0, high = bin->header.path_count;
+    while (low < high){
+        uint32_t middle = low + (high-low)/2;
+        size_t len = 0;
+        const char *path = bin_path(bin, middle, &len);
+        int order = path == NULL ? 1 : memcmp(path, prefix, len < prefix_len ? len : prefix_len);
+        if (order == 0 && len < prefix_len) order = -1;
+        if (order < 0 || (after && order == 0)) low = middle+1;
+        else high = middle;
+    }
+    return low;
+}
+
+typedef struct{
+    uint32_t from;
+    uint32_t to;
+} bin_range_t;
+
+int compare_ranges(const void *a, const void *b)
+{
+    const bin_range_t *x = a, *y = b;
+    return x->from < y->from ? -1 : x->from > y->from;
+}
+
+// print the records of a --format=bin file below any of `prefixes` (all of them without any) with any of
+// `tags` (all of them without any), for `tod query`. the paths below a prefix are found by a binary search
+// and their records through the index, the rest of the file is never read
+bool bin_query(const char *path, clags_list_t prefixes, clags_list_t tags, format_t format, search_mode_t mode, bool caret)
+{
+    bin_file_t bin;
+    if (!bin_open(&bin, path)){
+        bin_close(&bin);
+        return false;
+    }
+    matcher_t matcher;
+    if (!matcher_init(&matcher, bin.patterns, false)){
+        matcher_free(&matcher);
+        bin_close(&bin);
+        return false;
+    }
+    bool *wanted = calloc(matcher.count, sizeof(*wanted));
+    assert(wanted != NULL && "Out of memory!");
+    for (size_t i=0; i<matcher.count; ++i){
+        for (size_t j=0; j<tags.count && !wanted[i]; ++j){
+            const char *tag = clags_list_element(tags, char*, j);
+            wanted[i] = strcmp(tag, matcher.patterns[i]) == 0 || strcmp(tag, matcher.tags[i]) == 0;
+        }
+        if (tags.count == 0) wanted[i] = true;
+    }
+    // a tag the file does not have would print nothing, which reads as no matches
+    for (size_t j=0; j<tags.count; ++j){
+        const char *tag = clags_list_element(tags, char*, j);
+        bool known = false;
+        for (size_t i=0; i<matcher.count && !known; ++i){
+            known = strcmp(tag, matcher.patterns[i]) == 0 || strcmp(tag, matcher.tags[i]) == 0;
+        }
+        if (!known){
+            fprintf(stderr, "[ERROR] Unknown pattern or tag '%s'!\n", tag);
+            free(wanted);
+            matcher_free(&matcher);
+            bin_close(&bin);
+            return false;
+        }
+    }
+    size_t range_count = prefixes.count > 0 ? prefixes.count : 1;
+    bin_range_t *ranges = malloc(range_count*sizeof(*ranges));
+    assert(ranges != NULL && "Out of memory!");
+    ranges[0] = (bin_range_t){0, bin.header.path_count};
+    for (size_t i=0; i<prefixes.count; ++i){
+        const char *prefix = clags_list_element(prefixes, char*, i);
+        ranges[i] = (bin_range_t){bin_search(&bin, prefix, false), bin_search(&bin, prefix, true)};
+    }
+    // overlapping prefixes print their paths once
+    qsort(ranges, range_count, sizeof(*ranges), compare_ranges);
+
+    pool_t pool;
+    pool_init(&pool, 1, &matcher);
+    pool.format = format;
+    pool.mode = mode;
+    pool.caret = caret;
+    pool.flush_size = OUTPUT_BUFFER_SIZE;
+    worker_t *worker = &pool.workers[0];
+    bool ok = true;
+    char name[FILENAME_MAX];
+    print_header(&pool);
+    for (size_t r=0, next=0; r<range_count && ok; ++r){
+        for (uint32_t id = ranges[r].from > next ? ranges[r].from : next; id<ranges[r].to && ok; ++id){
+            uint64_t first = bin.index[id], last = bin.index[id+1];
+            size_t len = 0;
+            const char *file_path = bin_path(&bin, id, &len);
+            ok = file_path != NULL && first <= last && last <= bin.header.record_count;
+            arena_reset(&worker->file_arena);
+            worker->matches = (match_list_t){.arena=&worker->file_arena};
+            for (uint64_t i=first; ok && i<last; ++i){
+                bin_record_t record;
+                memcpy(&record, bin.data+bin.header.records+i*sizeof(record), sizeof(record));
+                ok = record.pattern < matcher.count && bin_fits(&bin, bin.header.texts, record.text, 1) &&
+                     bin_fits(&bin, bin.header.texts+record.text, record.text_len, 1);
+                if (!ok || !wanted[record.pattern]) continue;
+                matches_append(&worker->matches, (match_t){
+                    .line=record.line, .column=record.column, .pattern=record.pattern, .indent=record.indent,
+                    .text=bin.data+bin.header.texts+record.text, .text_len=record.text_len,
+                    .owner=record.owner, .ticket=record.ticket, .owner_len=record.owner_len,
+                    .ticket_len=record.ticket_len, .priority=record.priority,
+                });
+            }
+            if (!ok){
+                fprintf(stderr, "[ERROR] '%s' is corrupt!\n", path);
+                break;
+            }
+            snprintf(name, sizeof(name), "%.*s", (int) len, file_path);
+            if (worker->matches.count > 0) print_matches(worker, name, Change_None);
+            finish_file(worker);
+        }
+        if (ranges[r].to > next) next = ranges[r].to;
+    }
+    flush_output(&worker->out, pool.format);
+    print_footer(&pool);
+    pool_free(&pool);
+    free(ranges);
+    free(wanted);
+    matcher_free(&matcher);
+    bin_close(&bin);
+    return ok;
+}
+
+size_t default_jobs(void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (size_t) cores : 1;
 }
 
 clags_list_t input_paths = clags_path_list();
 clags_list_t ignore_names = clags_list();
+clags_list_t pattern_list = clags_list();
+uint32_t jobs = 0;
+uint32_t max_count = 0;
+uint32_t context_after = UINT32_MAX;   // until -A is given, so that -A0 overrides -C
+uint32_t context_before = UINT32_MAX;
+uint32_t context_lines = 0;
+uint32_t match_limit = 0;
+clags_choice_t binary_choice_items[] = {
+    {"skip", "do not search files that look binary"},
+    {"scan", "search all files"},
+};
+clags_choices_t binary_choices = clags_choices(binary_choice_items);
+clags_choice_t *binary_mode = &binary_choice_items[0];
+clags_choice_t format_choice_items[] = {
+    {"text",  "two lines per match: the location and line, then a caret under the match"},
+    {"jsonl", "one JSON object per match and line"},
+    {"csv",   "one CSV row per match, after a header row"},
+    {"sarif", "a SARIF 2.1.0 log"},
+    {"partial", "the binary results of one --shard, to combine with `tod merge`"},
+    {"bin",     "one binary file of all matches with an index by path, to read with `tod query`"},
+};
+clags_choices_t format_choices = clags_choices(format_choice_items);
+clags_choice_t *format = &format_choice_items[0];
+clags_choice_t sort_choice_items[] = {
+    {"none", "in the order the workers find the matches"},
+    {"path", "in path order, the same on every run and with any number of jobs"},
+};
+clags_choices_t sort_choices = clags_choices(sort_choice_items);
+clags_choice_t *sort_mode = &sort_choice_items[0];
+clags_choice_t follow_choice_items[] = {
+    {"always", "search the files and directories symbolic links lead to, each once"},
+    {"never",  "skip symbolic links below the input paths"},
+};
+clags_choices_t follow_choices = clags_choices(follow_choice_items);
+clags_choice_t *follow_mode = &follow_choice_items[0];
+clags_fsize_t sort_buffer = SORT_DEFAULT_BUDGET;
+clags_fsize_t split_size = SPLIT_DEFAULT_SIZE;
+bool gitignore = false;
+bool one_file_system = false;
+bool ignore_case = false;
+bool whole_words = false;
+bool search_compressed = false;
+bool comments_only = false;
+bool show_summary = false;
+bool no_caret = false;
+bool count_only = false;
+bool files_only = false;
+bool use_cache = false;
+bool show_stats = false;
+bool watch_mode = false;
+bool serve_mode = false;
+bool query_mode = false;
+char *socket_path = SERVE_DEFAULT_PATH;
+bool use_git = false;
+char *git_changed = NULL;
+char *shard_spec = NULL;
+clags_list_t partial_paths = clags_path_list();
+char *bin_path_arg = NULL;
+clags_list_t prefix_list = clags_list();
+char *cache_path = NULL;
 bool help = false;
 
-clags_arg_t args[] = {
-    clags_positional(&input_paths, "input_path", "the file or directory to search_in", .value_type=Clags_Path, .is_list=true),
-    clags_option('i', "ignore", &ignore_names, "NAME", "a file or directory to ignore", .is_list=true),
-    clags_flag_help(&help),
-};
+// `bench` includes this file to time its parts
+#ifndef TOD_NO_MAIN
+// `tod merge`; it is told apart from the input paths by hand, clags takes a subcommand only as the sole positional
+int merge_main(int argc, char *argv[])
+{
+    int result = 0;
+    const char *program_name = argv[0];
+    clags_arg_t args[] = {
+        clags_positional(&partial_paths, "partial", "a result written with --format=partial", .value_type=Clags_Path, .is_list=true),
+        clags_option('\0', "format", &format, "FORMAT", "the output format, defaults to text", .value_type=Clags_Choice, .choices=&format_choices),
+        clags_flag('c', "count", &count_only, "print only the amount of matches of each file with matches"),
+        clags_flag('l', "files-with-matches", &files_only, "print only the names of files with matches"),
+        clags_flag('\0', "no-caret", &no_caret, "print only 'file:line:col: text' without the caret line"),
+        clags_flag_help(&help),
+    };
+    clags_config_t config = clags_config(args);
+    if (clags_parse(argc, argv, &config) != NULL){
+        clags_usage(program_name, &config);
+        return_defer(1);
+    }
+    if (help){
+        clags_usage(program_name, &config);
+        return_defer(0);
+    }
+    format_t output_format = (format_t) clags_choice_index(&format_choices, format);
+    if (count_only && files_only){
+        fprintf(stderr, "[ERROR] --count and --files-with-matches cannot be combined!\n");
+        return_defer(1);
+    }
+    if (output_format == Format_Partial || output_format == Format_Bin || ((count_only || files_only) && output_format == Format_Sarif)){
+        fprintf(stderr, "[ERROR] merge cannot write --format=partial or --format=bin, nor --format=sarif with --count or --files-with-matches!\n");
+        return_defer(1);
+    }
+    search_mode_t mode = count_only ? Search_Count : files_only ? Search_First : Search_Lines;
+    if (!merge(partial_paths, output_format, mode, !no_caret)) result = 1;
+
+defer:
+    clags_list_free(&partial_paths);
+    return result;
+}
+
+// `tod query`, which reads a file written with --format=bin; the running --serve is asked with `tod --query`
+int query_main(int argc, char *argv[])
+{
+    int result = 0;
+    const char *program_name = argv[0];
+    clags_arg_t args[] = {
+        clags_positional(&bin_path_arg, "results", "a file written with --format=bin", .value_type=Clags_Path),
+        clags_option('\0', "prefix", &prefix_list, "PREFIX", "print only the files whose path starts with PREFIX, can be repeated", .is_list=true),
+        clags_option('p', "pattern", &pattern_list, "TAG", "print only the matches of the pattern or tag TAG, can be repeated", .is_list=true),
+        clags_option('\0', "format", &format, "FORMAT", "the output format, defaults to text", .value_type=Clags_Choice, .choices=&format_choices),
+        clags_flag('c', "count", &count_only, "print only the amount of matches of each file with matches"),
+        clags_flag('l', "files-with-matches", &files_only, "print only the names of files with matches"),
+        clags_flag('\0', "no-caret", &no_caret, "print only 'file:line:col: text' without the caret line"),
+        clags_flag_help(&help),
+    };
+    clags_config_t config = clags_config(args);
+    if (clags_parse(argc, argv, &config) != NULL){
+        clags_usage(program_name, &config);
+        return_defer(1);
+    }
+    if (help){
+        clags_usage(program_name, &config);
+        return_defer(0);
+    }
+    format_t output_format = (format_t) clags_choice_index(&format_choices, format);
+    if (count_only && files_only){
+        fprintf(stderr, "[ERROR] --count and --files-with-matches cannot be combined!\n");
+        return_defer(1);
+    }
+    if (output_format == Format_Partial || output_format == Format_Bin || ((count_only || files_only) && output_format == Format_Sarif)){
+        fprintf(stderr, "[ERROR] query cannot write --format=partial or --format=bin, nor --format=sarif with --count or --files-with-matches!\n");
+        return_defer(1);
+    }
+    search_mode_t mode = count_only ? Search_Count : files_only ? Search_First : Search_Lines;
+    if (!bin_query(bin_path_arg, prefix_list, pattern_list, output_format, mode, !no_caret)) result = 1;
+
+defer:
+    clags_list_free(&prefix_list);
+    clags_list_free(&pattern_list);
+    return result;
+}
 
-int main(int argc, char *argv[]) 
+int main(int argc, char *argv[])
 {
     int result = 0;
     const char *program_name = argv[0];
+    if (argc > 1 && strcmp(argv[1], "merge") == 0) return merge_main(argc-1, argv+1);
+    if (argc > 1 && strcmp(argv[1], "query") == 0) return query_main(argc-1, argv+1);
+    clags_arg_t args[] = {
+        clags_positional(&input_paths, "input_path", "the file or directory to search_in", .value_type=Clags_Path, .is_list=true),
+        clags_option('i', "ignore", &ignore_names, "GLOB", "a file or directory to ignore, in .gitignore syntax", .is_list=true),
+        clags_option('p', "pattern", &pattern_list, "PATTERN", "a pattern to search for, can be repeated, defaults to 'TODO:'", .is_list=true),
+        clags_option('m', "max-count", &max_count, "N", "report at most N matches per file", .value_type=Clags_UInt32),
+        clags_option('A', "after-context", &context_after, "N", "print N lines after each match", .value_type=Clags_UInt32),
+        clags_option('B', "before-context", &context_before, "N", "print N lines before each match", .value_type=Clags_UInt32),
+        clags_option('C', "context", &context_lines, "N", "print N lines before and after each match, unless -A or -B say otherwise", .value_type=Clags_UInt32),
+        clags_option('\0', "limit", &match_limit, "N", "stop the scan after N matches in total", .value_type=Clags_UInt32),
+        clags_option('j', "jobs", &jobs, "N", "the number of worker threads, defaults to the number of cores", .value_type=Clags_UInt32),
+        clags_option('\0', "binary", &binary_mode, "MODE", "how to treat binary files, defaults to skip", .value_type=Clags_Choice, .choices=&binary_choices),
+        clags_option('\0', "cache-file", &cache_path, "PATH", "the scan cache to use, implies --cache"),
+        clags_option('\0', "format", &format, "FORMAT", "the output format, defaults to text", .value_type=Clags_Choice, .choices=&format_choices),
+        clags_option('\0', "sort", &sort_mode, "ORDER", "the order of the output, defaults to none", .value_type=Clags_Choice, .choices=&sort_choices),
+        clags_option('\0', "shard", &shard_spec, "K/N", "search only the K-th of N shards of the files, picked by hashing their paths"),
+        clags_option('\0', "split-size", &split_size, "SIZE", "files larger than SIZE are split into chunks that all workers search, defaults to 16MiB, 0 to never split", .value_type=Clags_Size),
+        clags_option('\0', "sort-buffer", &sort_buffer, "SIZE", "the output held in memory with --sort before it spills to a temporary file, defaults to 64MiB", .value_type=Clags_Size),
+        clags_flag('I', "ignore-case", &ignore_case, "match ASCII letters in either case"),
+        clags_flag('w', "word", &whole_words, "match patterns that start or end with a letter, digit or '_' only as whole words"),
+        clags_flag('\0', "comments-only", &comments_only, "in C, C++, JavaScript, TypeScript, Rust, Python and shell files, report only matches inside comments"),
+        clags_flag('c', "count", &count_only, "print only the amount of matches of each file with matches"),
+        clags_flag('\0', "summary", &show_summary, "print only the amount of matches by tag, owner, priority and directory"),
+        clags_flag('l', "files-with-matches", &files_only, "print only the names of files with matches"),
+        clags_flag('\0', "no-caret", &no_caret, "print only 'file:line:col: text' without the caret line"),
+        clags_flag('\0', "git", &use_git, "search only the files in the git index instead of walking directories"),
+        clags_option('\0', "git-changed", &git_changed, "REV", "search only the files that differ from the git revision REV, like 'HEAD'"),
+        clags_flag('\0', "gitignore", &gitignore, "skip what .gitignore and .ignore files exclude"),
+        clags_option('\0', "follow", &follow_mode, "MODE", "whether to follow symbolic links below the input paths, defaults to always", .value_type=Clags_Choice, .choices=&follow_choices),
+        clags_flag('\0', "one-file-system", &one_file_system, "do not descend into directories on other file systems than their input path"),
+        clags_flag('z', "search-compressed", &search_compressed, "search inside .gz, .zst, .xz and .bz2 files and tar archives, without unpacking them to disk"),
+        clags_option('\0', "socket", &socket_path, "PATH", "the socket of --serve and --query, defaults to '" SERVE_DEFAULT_PATH "'"),
+        clags_flag('\0', "serve", &serve_mode, "keep the matches below the input paths up to date and answer --query on a Unix socket"),
+        clags_flag('\0', "query", &query_mode, "ask the running --serve for its matches below the input paths, filtered by -p"),
+        clags_flag('\0', "watch", &watch_mode, "after the first scan, print the matches added and removed whenever files change"),
+        clags_flag('\0', "stats", &show_stats, "report counters and the time spent in each phase on stderr"),
+        clags_flag('\0', "cache", &use_cache, "replay the results of unchanged files from the scan cache '" CACHE_DEFAULT_PATH "'"),
+        clags_flag_help(&help),
+    };
     clags_config_t config = clags_config(args);
     if (clags_parse(argc, argv, &config) != NULL){
         clags_usage(program_name, &config);
@@ -142,21 +6144,165 @@ int main(int argc, char *argv[])
         clags_usage(program_name, &config);
         return_defer(0);
     }
-    const char *needle = "TODO:"; // this line should pop up when you run tod on this directory
+    format_t output_format = (format_t) clags_choice_index(&format_choices, format);
+    if (count_only && files_only){
+        fprintf(stderr, "[ERROR] --count and --files-with-matches cannot be combined!\n");
+        return_defer(1);
+    }
+    if ((count_only || files_only) && output_format == Format_Sarif){
+        fprintf(stderr, "[ERROR] --format=sarif cannot be combined with --count or --files-with-matches!\n");
+        return_defer(1);
+    }
+    if (serve_mode + query_mode + watch_mode > 1){
+        fprintf(stderr, "[ERROR] Only one of --watch, --serve and --query can be given!\n");
+        return_defer(1);
+    }
+    if ((watch_mode || serve_mode) && (count_only || files_only || match_limit > 0 || use_git || git_changed != NULL)){
+        fprintf(stderr, "[ERROR] --watch and --serve cannot be combined with --count, --files-with-matches, --limit, --git or --git-changed!\n");
+        return_defer(1);
+    }
+    if ((watch_mode || serve_mode) && search_compressed){
+        fprintf(stderr, "[ERROR] --watch and --serve cannot be combined with --search-compressed!\n");
+        return_defer(1);
+    }
+    if (watch_mode && (output_format == Format_Csv || output_format == Format_Sarif)){
+        fprintf(stderr, "[ERROR] --watch only supports --format=text and --format=jsonl!\n");
+        return_defer(1);
+    }
+    unsigned shard = 0, shard_count = 0;
+    if (shard_spec != NULL){
+        int consumed = 0;
+        if (sscanf(shard_spec, "%u/%u%n", &shard, &shard_count, &consumed) != 2 || shard_spec[consumed] != '\0' ||
+            shard < 1 || shard > shard_count){
+            fprintf(stderr, "[ERROR] Invalid shard '%s', expected K/N with 1 <= K <= N!\n", shard_spec);
+            return_defer(1);
+        }
+    }
+    if ((output_format == Format_Partial || output_format == Format_Bin) && (count_only || files_only || watch_mode || serve_mode || query_mode || show_summary)){
+        fprintf(stderr, "[ERROR] --format=partial and --format=bin cannot be combined with --count, --files-with-matches, --watch, --serve, --query or --summary!\n");
+        return_defer(1);
+    }
+    if (shard_spec != NULL && (watch_mode || serve_mode || query_mode)){
+        fprintf(stderr, "[ERROR] --shard cannot be combined with --watch, --serve or --query!\n");
+        return_defer(1);
+    }
+    if (show_summary && (count_only || files_only || output_format != Format_Text || watch_mode || serve_mode || query_mode)){
+        fprintf(stderr, "[ERROR] --summary cannot be combined with --count, --files-with-matches, --format, --watch, --serve or --query!\n");
+        return_defer(1);
+    }
+    if (context_after == UINT32_MAX) context_after = context_lines;
+    if (context_before == UINT32_MAX) context_before = context_lines;
+    bool context = context_after > 0 || context_before > 0;
+    if (context && (count_only || files_only || output_format != Format_Text || show_summary || watch_mode || serve_mode || query_mode)){
+        fprintf(stderr, "[ERROR] -A, -B and -C cannot be combined with --count, --files-with-matches, --format, --summary, --watch, --serve or --query!\n");
+        return_defer(1);
+    }
+    // the cache keeps the matches but not the lines around them
+    if (context && (use_cache || cache_path != NULL)){
+        fprintf(stderr, "[ERROR] -A, -B and -C cannot be combined with --cache!\n");
+        return_defer(1);
+    }
+    if (query_mode){
+        // the patterns only pick among those of the server
+        pool_t client = {.mode=count_only ? Search_Count : files_only ? Search_First : Search_Lines, .format=output_format, .caret=!no_caret};
+        return_defer(query(socket_path, &client, pattern_list, input_paths) ? 0 : 1);
+    }
+    matcher_t matcher;
+    if (!matcher_init(&matcher, pattern_list, ignore_case)){
+        matcher_free(&matcher);
+        return_defer(1);
+    }
+    matcher.words = whole_words;
+    pool_t pool;
+    pool_init(&pool, jobs > 0 ? jobs : default_jobs(), &matcher);
+    pool.gitignore = gitignore;
+    pool.follow = clags_choice_index(&follow_choices, follow_mode) == 0;
+    pool.one_file_system = one_file_system;
+    pool.format = output_format;
+    pool.mode = count_only ? Search_Count : files_only ? Search_First : Search_Lines;
+    pool.max_count = max_count;
+    pool.limit = match_limit;
+    pool.caret = !no_caret;
+    pool.before = context_before;
+    pool.after = context_after;
+    pool.sort = clags_choice_index(&sort_choices, sort_mode) == 1;
+    pool.sorter.budget = sort_buffer;
+    pool.split_size = split_size;
+    pool.stats = show_stats;
+    pool.flush_size = isatty(STDOUT_FILENO) ? 0 : OUTPUT_BUFFER_SIZE;
+    pool.skip_binary = clags_choice_index(&binary_choices, binary_mode) == 0;
+    pool.unpack = search_compressed;
+    pool.comments_only = comments_only;
+    pool.summary = show_summary;
+    pool.shard = shard > 0 ? shard-1 : 0;
+    pool.shard_count = shard_count;
+    cache_t cache;
+    if (use_cache || cache_path != NULL){
+        cache_load(&cache, cache_path != NULL ? cache_path : CACHE_DEFAULT_PATH, cache_fingerprint(&pool));
+        pool.cache = &cache;
+    }
+    watch_t watch;
+    if (watch_mode || serve_mode){
+        watch_init(&watch, &pool);
+        pool.index = true;
+        pool.quiet = serve_mode;
+    }
     for (size_t i=0; i<input_paths.count; ++i){
         char *input_path = clags_list_element(input_paths, char*, i);
         struct stat attrs;
         if (stat(input_path, &attrs) == -1) continue;
         if (S_ISREG(attrs.st_mode)){
-            search_file(input_path, needle);
+            if (watch_mode || serve_mode) watch_add_root(&watch, input_path, NULL, false);
+            pool_seed(&pool, Task_File, input_path, NULL);
         } else if (S_ISDIR(attrs.st_mode)){
-            search_dir(input_path, needle, ignore_names);
+            // normalize the root, so the paths joined below it are normalized too
+            char root[FILENAME_MAX];
+            cwk_path_normalize(input_path, root, sizeof(root));
+            ignore_t *ignore = ignore_from_list(ignore_names, root);
+            if (gitignore){
+                ignore_t *ancestors = ignore_load_ancestors(ignore, root);
+                ignore_release(ignore);
+                ignore = ancestors;
+            }
+            if (watch_mode || serve_mode) watch_add_root(&watch, root, ignore, true);
+            if (use_git || git_changed != NULL){
+                if (!pool_seed_git(&pool, root, ignore, git_changed)) result = 1;
+            } else {
+                pool_seed(&pool, Task_Dir, root, ignore);
+            }
+            ignore_release(ignore);
         } else {
             continue;
         }
     }
+    uint64_t started = clock_ns();
+    if (!serve_mode) print_header(&pool);
+    pool_run(&pool);
+    if (!serve_mode) print_footer(&pool);
+    if (show_summary) summary_print(&pool);
+    if (output_format == Format_Bin && !bin_write(&pool)) result = 1;
+    if (show_stats) stats_print(&pool, clock_ns() - started);
+    if (pool.cache != NULL){
+        if (!cache_save(&cache, &pool, input_paths)) result = 1;
+        cache_free(&cache);
+    }
+    if (serve_mode){
+        watch_start(&watch);
+        if (!serve(&watch, socket_path)) result = 1;
+        watch_free(&watch);
+    } else if (watch_mode){
+        // runs until interrupted
+        watch_start(&watch);
+        while (watch_wait(&watch)) watch_update(&watch, true);
+        result = 1;
+        watch_free(&watch);
+    }
+    pool_free(&pool);
+    matcher_free(&matcher);
 
 defer:
     clags_list_free(&ignore_names);
+    clags_list_free(&pattern_list);
     return result;
 }
+#endif // TOD_NO_MAIN